@@ -58,8 +58,26 @@
 #define configUSE_ALTERNATIVE_API				0
 #define configUSE_QUEUE_SETS					1
 #define configUSE_TASK_NOTIFICATIONS			1
+#define configTASK_NOTIFICATION_ARRAY_ENTRIES	3 /* Index 1 is used by state_call() replies, index 2 by state_core flags. */
+#define configNUM_THREAD_LOCAL_STORAGE_POINTERS	1 /* Used by state_core to find the running state machine. */
 #define configSUPPORT_STATIC_ALLOCATION			1
 
+/* Virtual time simulation.  When set to 1 the tick count is not left to the
+wall clock while every task is blocked - the idle task jumps it straight to the
+next timer or timeout deadline instead.  Tasks still unblock on exactly the
+same ticks and in the same order, so long state machine scenarios run many
+times faster than real time.  The jump is implemented by
+vVirtualTimeSuppressTicks() and the idle hook in main.c. */
+#define configUSE_VIRTUAL_TIME					0
+
+#if ( configUSE_VIRTUAL_TIME == 1 )
+	/* The tickless idle hook is only used to learn the expected idle time, it
+	does not sleep. */
+	#define configUSE_TICKLESS_IDLE				1
+	void vVirtualTimeSuppressTicks( uint32_t ulExpectedIdleTime );
+	#define portSUPPRESS_TICKS_AND_SLEEP( xExpectedIdleTime ) vVirtualTimeSuppressTicks( xExpectedIdleTime )
+#endif
+
 /* Software timer related configuration options.  The maximum possible task
 priority is configMAX_PRIORITIES - 1.  The priority of the timer task is
 deliberately set higher to ensure it is correctly capped back to
@@ -31,6 +31,8 @@
  */
 
 #include <string.h>
+#include <stdio.h>
+#include <stddef.h>
 
 #include "FreeRTOS.h"
 #include "task.h"
@@ -39,6 +41,20 @@
 #include "semphr.h"
 #include "stream_buffer.h"
 #include "message_buffer.h"
+#include "global_defines.h"
+#include "state_harness.h"
+#include "state_fleet.h"
+#include "state_shm.h"
+#include "state_ingress.h"
+#include "console.h"
+
+#ifdef POSIX_FREERTOS_SIM
+	#include <fcntl.h>
+	#include <sys/ioctl.h>
+	#include <sys/mman.h>
+	#include <sys/socket.h>
+	#include <unistd.h>
+#endif
 
 /*-----------------------------------------------------------*/
 
@@ -84,6 +100,27 @@ static BaseType_t prvTaskTags( void );
  */
 static BaseType_t prvTimerQuery( void );
 
+/*
+ * Fuzzes a small state machine through the scheduler free state_core harness
+ * and checks every state and transition of the machine was reached.
+ */
+static BaseType_t prvStateHarness( void );
+
+/*
+ * Checks the transition table of a fleet against next_state, and that
+ * applying events to a fleet, whichever lookup it uses, moves every instance
+ * as next_state would.
+ */
+static BaseType_t prvStateFleet( void );
+
+/*
+ * Runs a machine through the real state_core and checks routing by
+ * subscription, defer and replay, delayed and cancelled events, the key table
+ * and checkpoint / restore.  Needs state_core_spawner() to have run and the
+ * scheduler to be started.
+ */
+static BaseType_t prvStateCore( void );
+
 /*-----------------------------------------------------------*/
 
 static BaseType_t prvStaticAllocationsWithNullBuffers( void )
@@ -596,6 +633,1150 @@ const UBaseType_t uxTimerNumber = ( UBaseType_t ) 55;
 }
 /*-----------------------------------------------------------*/
 
+/* Machine used by prvStateHarness().  Idle moves to busy on harnessSTART, busy
+either completes on harnessFINISH or is stopped by harnessABORT, and the done
+state forces an immediate transition back to idle. */
+#define harnessSTART	( ( state_event_t ) 0 )
+#define harnessFINISH	( ( state_event_t ) 1 )
+#define harnessABORT	( ( state_event_t ) 2 )
+#define harnessIGNORED	( ( state_event_t ) 3 )
+
+enum { eHarnessIdle, eHarnessBusy, eHarnessDone, eHarnessStates };
+
+static state_t prvHarnessWait( void )
+{
+	return NULL_STATE;
+}
+
+static state_t prvHarnessDone( void )
+{
+	return eHarnessIdle;
+}
+
+static void prvHarnessNextState( state_t *pxState, state_event_t xEvent )
+{
+	if( ( *pxState == eHarnessIdle ) && ( xEvent == harnessSTART ) )
+	{
+		*pxState = eHarnessBusy;
+	}
+	else if( ( *pxState == eHarnessBusy ) && ( xEvent == harnessFINISH ) )
+	{
+		*pxState = eHarnessDone;
+	}
+	else if( ( *pxState == eHarnessBusy ) && ( xEvent == harnessABORT ) )
+	{
+		*pxState = eHarnessIdle;
+	}
+}
+
+static bool prvHarnessFilter( state_event_t xEvent )
+{
+	return ( xEvent != harnessIGNORED );
+}
+
+static char *prvHarnessEventPrint( state_event_t xEvent )
+{
+	( void ) xEvent;
+	return NULL;
+}
+
+static BaseType_t prvStateHarness( void )
+{
+static state_array_s xHarnessTable[ eHarnessStates ] =
+{
+	{ prvHarnessWait, portMAX_DELAY },
+	{ prvHarnessWait, 10 },
+	{ prvHarnessDone, portMAX_DELAY },
+};
+static state_init_s xHarnessMachine =
+{
+	.next_state        = prvHarnessNextState,
+	.translation_table = xHarnessTable,
+	.event_print       = prvHarnessEventPrint,
+	.starting_state    = eHarnessIdle,
+	.state_name_string = "harness",
+	.filter_event      = prvHarnessFilter,
+	.total_states      = eHarnessStates,
+};
+static state_harness_s xHarness;
+const state_event_t xAlphabet[] = { harnessSTART, harnessFINISH, harnessABORT, harnessIGNORED, INVALID_EVENT };
+BaseType_t xReturn = pdPASS;
+
+	state_harness_init( &xHarness, &xHarnessMachine, pdTRUE );
+	( void ) state_harness_fuzz( &xHarness, xAlphabet, sizeof( xAlphabet ) / sizeof( xAlphabet[ 0 ] ), 0x1234, 100, 16 );
+
+	/* Idle->busy, busy->done, busy->idle and the forced done->idle. */
+	if( ( xHarness.transitions[ eHarnessIdle ][ 0 ] != ( 1u << eHarnessBusy ) ) ||
+		( xHarness.transitions[ eHarnessBusy ][ 0 ] != ( ( 1u << eHarnessIdle ) | ( 1u << eHarnessDone ) ) ) ||
+		( xHarness.transitions[ eHarnessDone ][ 0 ] != ( 1u << eHarnessIdle ) ) )
+	{
+		xReturn = pdFAIL;
+	}
+
+	if( ( xHarness.filtered_events == 0 ) || ( xHarness.livelocks != 0 ) )
+	{
+		xReturn = pdFAIL;
+	}
+
+	return xReturn;
+}
+/*-----------------------------------------------------------*/
+
+/* Fleet of the harness machine.  More than 16 instances, so the shuffle lookup
+(if the CPU has it) and the scalar tail both run. */
+#define fleetINSTANCES	( 37 )
+#define fleetEVENTS		( harnessIGNORED + 1 )
+
+STATE_FLEET_STORAGE( xHarness, fleetINSTANCES, 0 );
+
+static BaseType_t prvStateFleet( void )
+{
+static state_init_s xFleetMachine =
+{
+	.next_state        = prvHarnessNextState,
+	.event_print       = prvHarnessEventPrint,
+	.starting_state    = eHarnessIdle,
+	.state_name_string = "harness fleet",
+	.total_states      = eHarnessStates,
+};
+static state_fleet_s xFleet;
+uint8_t ucExpected[ fleetINSTANCES ];
+uint32_t ulMoved;
+state_t xState;
+state_event_t xEvent;
+UBaseType_t uxInstance;
+BaseType_t xReturn = pdPASS;
+
+	state_fleet_init( &xFleet, &xFleetMachine, harnessSTART, fleetEVENTS, STATE_FLEET_STORAGE_ARGS( xHarness ) );
+
+	for( xEvent = 0; xEvent < fleetEVENTS; xEvent++ )
+	{
+		for( xState = 0; xState < eHarnessStates; xState++ )
+		{
+			state_t xNext = xState;
+
+			prvHarnessNextState( &xNext, harnessSTART + xEvent );
+
+			if( xFleet.transitions[ xEvent ][ xState ] != xNext )
+			{
+				xReturn = pdFAIL;
+			}
+		}
+	}
+
+	/* Spread the instances over every state. */
+	for( uxInstance = 0; uxInstance < fleetINSTANCES; uxInstance++ )
+	{
+		if( state_fleet_add( &xFleet, NULL ) != ( int32_t ) uxInstance )
+		{
+			return pdFAIL;
+		}
+
+		xHarness_fleet_states[ uxInstance ] = uxInstance % eHarnessStates;
+	}
+
+	for( xEvent = harnessSTART; xEvent < harnessSTART + fleetEVENTS; xEvent++ )
+	{
+		ulMoved = 0;
+
+		for( uxInstance = 0; uxInstance < fleetINSTANCES; uxInstance++ )
+		{
+			xState = xHarness_fleet_states[ uxInstance ];
+			prvHarnessNextState( &xState, xEvent );
+			ulMoved += ( xState != xHarness_fleet_states[ uxInstance ] );
+			ucExpected[ uxInstance ] = ( uint8_t ) xState;
+		}
+
+		if( ( state_fleet_apply( &xFleet, xEvent ) != ulMoved ) ||
+			( memcmp( ucExpected, xHarness_fleet_states, sizeof( ucExpected ) ) != 0 ) )
+		{
+			xReturn = pdFAIL;
+		}
+	}
+
+	return xReturn;
+}
+/*-----------------------------------------------------------*/
+
+/* Machine used by prvStateCore() and the checks it runs, run by the real
+state_core.  It subscribes to the probe namespace only, counts what it is
+handed in its context and gives xProbeHandled for every event it handled, so
+the checks wait for the probe rather than for time to pass. */
+#define probeEVENT_START	( ( state_event_t ) 900 )
+#define probeWORK			( probeEVENT_START + 0 )
+#define probeFIRE			( probeEVENT_START + 1 )
+#define probePING			( probeEVENT_START + 2 )
+#define probeASK			( probeEVENT_START + 3 )
+#define probeBUSY			( probeEVENT_START + 4 )
+#define probeDONE			( probeEVENT_START + 5 )
+#define probeANSWER			( 42 )
+#define probeOUTSIDE		( probeEVENT_START + STATE_NAMESPACE_SIZE )
+#define probeBRIDGED		( probeEVENT_START + 6 )
+#define probeSOURCED		( probeEVENT_START + 7 )
+#define probeSOURCE_LENGTH	( 4 )
+#define probeMESSAGE		( probeEVENT_START + 8 )
+#define probeMESSAGE_BUFFER	( 256 )
+#define probeKEY			( 0xC0FFEEUL )
+#define probeMAX_HANDLED	( 64 )
+#define probeWAIT_TICKS		pdMS_TO_TICKS( 1000 )
+
+enum { eProbeIdle, eProbeBusy, eProbeStates };
+
+typedef struct
+{
+	uint32_t ulWork;
+	uint32_t ulFired;
+	uint32_t ulWorkWhenDone;
+	uint32_t ulBridged;
+	uint32_t ulFlagOrder;
+	uint32_t ulSourced;
+	uint32_t ulMessages;
+	uint32_t ulMessageBytes;
+	uint32_t ulMessageSum;
+	uint32_t ulNoPayload;
+	uint32_t ulSeen;
+} ProbeContext_t;
+
+static ProbeContext_t xProbeContext;
+static SemaphoreHandle_t xProbeHandled = NULL;
+static QueueHandle_t xProbeSource = NULL;
+static state_handle_t xProbe;
+
+#if ( STATE_CORE_STATIC_ALLOCATION == 1 )
+	STATE_MACHINE_STATIC_STORAGE( probe, 4096 );
+	STATE_MACHINE_STATIC_MESSAGES( probe, probeMESSAGE_BUFFER );
+#endif
+
+static state_t prvProbeWait( void )
+{
+	return NULL_STATE;
+}
+
+static void prvProbeNextState( state_t *pxState, state_event_t xEvent )
+{
+ProbeContext_t *pxContext = state_context();
+
+	pxContext->ulSeen++;
+
+	/* The payload is only lent until next_state returns, keep a sum of it. */
+	if( xEvent == probeMESSAGE )
+	{
+	const uint8_t *pucPayload;
+	size_t xLength = 0;
+
+		pucPayload = state_message_payload( &xLength );
+
+		if( pucPayload == NULL )
+		{
+			pxContext->ulNoPayload++;
+		}
+		else
+		{
+			pxContext->ulMessages++;
+			pxContext->ulMessageBytes += xLength;
+
+			while( xLength-- > 0 )
+			{
+				pxContext->ulMessageSum += *pucPayload++;
+			}
+		}
+	}
+
+	/* One nibble per flag, in the order they arrived. */
+	if( STATE_IS_FLAG_EVENT( xEvent ) )
+	{
+		pxContext->ulFlagOrder = ( pxContext->ulFlagOrder << 4 ) | ( xEvent - STATE_FLAG_EVENT_START + 1 );
+	}
+
+	switch( *pxState )
+	{
+		case eProbeIdle:
+			if( xEvent == probeWORK )
+			{
+				pxContext->ulWork++;
+			}
+			else if( xEvent == probeFIRE )
+			{
+				pxContext->ulFired++;
+			}
+			else if( xEvent == probeASK )
+			{
+				( void ) state_reply( probeANSWER );
+			}
+			else if( xEvent == probeBUSY )
+			{
+				*pxState = eProbeBusy;
+			}
+			else if( xEvent == probeBRIDGED )
+			{
+				pxContext->ulBridged++;
+			}
+			break;
+
+		case eProbeBusy:
+			if( xEvent == probeDONE )
+			{
+				pxContext->ulWorkWhenDone = pxContext->ulWork;
+				*pxState = eProbeIdle;
+			}
+			else if( xEvent == probeFIRE )
+			{
+				pxContext->ulFired++;
+			}
+			break;
+	}
+
+	xSemaphoreGive( xProbeHandled );
+}
+
+/* Takes an item off the probe's extra source queue, on the probe task.  A zero
+item is swallowed, the probe keeps waiting. */
+static state_event_t prvProbeSourceReady( QueueSetMemberHandle_t xSource )
+{
+ProbeContext_t *pxContext = state_context();
+uint32_t ulItem = 0;
+
+	if( ( xQueueReceive( ( QueueHandle_t ) xSource, &ulItem, 0 ) != pdTRUE ) || ( ulItem == 0 ) )
+	{
+		return INVALID_EVENT;
+	}
+
+	pxContext->ulSourced += ulItem;
+	return probeSOURCED;
+}
+
+/* Waits for the probe to have handled uxEvents more events. */
+static BaseType_t prvProbeWaitHandled( UBaseType_t uxEvents )
+{
+	while( uxEvents-- > 0 )
+	{
+		if( xSemaphoreTake( xProbeHandled, probeWAIT_TICKS ) != pdTRUE )
+		{
+			return pdFAIL;
+		}
+	}
+
+	return pdPASS;
+}
+
+/* Flags reach the probe lowest first, and only the ones in its flag_mask.
+Pending flags go before queued events, so a flag outside the mask would show
+up before the work posted after it. */
+static BaseType_t prvStateCoreFlags( void )
+{
+uint32_t ulWork = xProbeContext.ulWork;
+BaseType_t xReturn = pdPASS;
+
+	xProbeContext.ulFlagOrder = 0;
+	state_post_flags( STATE_FLAG( 2 ) | STATE_FLAG( 1 ) | STATE_FLAG( 0 ) );
+
+	if( ( prvProbeWaitHandled( 2 ) != pdPASS ) || ( xProbeContext.ulFlagOrder != 0x12 ) )
+	{
+		xReturn = pdFAIL;
+	}
+
+	state_post_event( probeWORK );
+
+	if( ( prvProbeWaitHandled( 1 ) != pdPASS ) || ( xProbeContext.ulFlagOrder != 0x12 ) || ( xProbeContext.ulWork != ulWork + 1 ) )
+	{
+		xReturn = pdFAIL;
+	}
+
+	return xReturn;
+}
+
+/* The probe also wakes on its source queue.  An item on_ready swallows never
+reaches next_state. */
+static BaseType_t prvStateCoreSources( void )
+{
+const uint32_t ulSwallowed = 0, ulItem = 7;
+uint32_t ulSeen = xProbeContext.ulSeen;
+uint32_t ulSourced = xProbeContext.ulSourced;
+BaseType_t xReturn = pdPASS;
+
+	( void ) xQueueSendToBack( xProbeSource, &ulSwallowed, 0 );
+	( void ) xQueueSendToBack( xProbeSource, &ulItem, 0 );
+
+	if( ( prvProbeWaitHandled( 1 ) != pdPASS ) || ( xProbeContext.ulSourced != ulSourced + ulItem ) )
+	{
+		xReturn = pdFAIL;
+	}
+
+	/* Queued behind the source items, so both were taken by now. */
+	state_post_event( probeWORK );
+
+	if( ( prvProbeWaitHandled( 1 ) != pdPASS ) || ( xProbeContext.ulSeen != ulSeen + 2 ) ||
+		( uxQueueMessagesWaiting( xProbeSource ) != 0 ) )
+	{
+		xReturn = pdFAIL;
+	}
+
+	return xReturn;
+}
+
+/* A message hands next_state a copy of its payload, the same event posted
+plainly has none. */
+static BaseType_t prvStateCoreMessages( void )
+{
+static const char cPayload[] = "state_core";
+ProbeContext_t xBefore = xProbeContext;
+uint32_t ulSum = 0;
+size_t x;
+BaseType_t xReturn = pdPASS;
+
+	for( x = 0; x < sizeof( cPayload ); x++ )
+	{
+		ulSum += ( uint8_t ) cPayload[ x ];
+	}
+
+	if( ( state_post_message( xProbe, probeMESSAGE, cPayload, sizeof( cPayload ), probeWAIT_TICKS ) != true ) ||
+		( state_post_message( xProbe, probeMESSAGE, NULL, 0, probeWAIT_TICKS ) != true ) )
+	{
+		xReturn = pdFAIL;
+	}
+
+	state_post_event( probeMESSAGE );
+
+	if( ( prvProbeWaitHandled( 3 ) != pdPASS ) ||
+		( xProbeContext.ulMessages != xBefore.ulMessages + 2 ) ||
+		( xProbeContext.ulMessageBytes != xBefore.ulMessageBytes + sizeof( cPayload ) ) ||
+		( xProbeContext.ulMessageSum != xBefore.ulMessageSum + ulSum ) ||
+		( xProbeContext.ulNoPayload != xBefore.ulNoPayload + 1 ) )
+	{
+		xReturn = pdFAIL;
+	}
+
+	return xReturn;
+}
+
+/* A cancelled delayed event never arrives, the one left running does. */
+static BaseType_t prvStateCoreTimers( void )
+{
+const TickType_t xDelay = pdMS_TO_TICKS( 20 );
+uint32_t ulWork = xProbeContext.ulWork;
+state_timer_t xTimer;
+BaseType_t xReturn = pdPASS;
+
+	xTimer = state_post_event_after( probeWORK, xDelay );
+	( void ) state_post_event_after( probeFIRE, xDelay * 2 );
+
+	if( state_cancel_event( xTimer ) != true )
+	{
+		xReturn = pdFAIL;
+	}
+
+	/* Cancelling twice, or a handle that was never returned, does nothing. */
+	if( ( state_cancel_event( xTimer ) != false ) || ( state_cancel_event( STATE_TIMER_INVALID ) != false ) )
+	{
+		xReturn = pdFAIL;
+	}
+
+	if( ( prvProbeWaitHandled( 1 ) != pdPASS ) || ( xProbeContext.ulFired != 1 ) || ( xProbeContext.ulWork != ulWork ) )
+	{
+		xReturn = pdFAIL;
+	}
+
+	return xReturn;
+}
+
+/* A call is answered with the state the probe is left in, unless the handler
+replies itself. */
+static BaseType_t prvStateCoreCalls( void )
+{
+uint32_t ulReply = ~0u;
+BaseType_t xReturn = pdPASS;
+
+	if( ( state_call( xProbe, probePING, &ulReply, probeWAIT_TICKS ) != true ) || ( ulReply != eProbeIdle ) )
+	{
+		xReturn = pdFAIL;
+	}
+
+	if( ( state_call( xProbe, probeASK, &ulReply, probeWAIT_TICKS ) != true ) || ( ulReply != probeANSWER ) )
+	{
+		xReturn = pdFAIL;
+	}
+
+	/* Outside of a call there is nothing to reply to. */
+	if( state_reply( probeANSWER ) != false )
+	{
+		xReturn = pdFAIL;
+	}
+
+	xReturn &= prvProbeWaitHandled( 2 );
+
+	return xReturn;
+}
+
+/* Stops the probe while it is busy and restarts it from a checkpoint, in the
+busy state and with the context it had.  Leaves the probe idle. */
+static BaseType_t prvStateCoreCheckpoint( state_init_s *pxProbeMachine )
+{
+static uint8_t ucImage[ 2048 ];
+ProbeContext_t xSaved;
+uint32_t ulReply = ~0u;
+size_t xLength;
+BaseType_t xReturn = pdPASS;
+
+	state_post_event( probeBUSY );
+	xReturn &= prvProbeWaitHandled( 1 );
+
+	xLength = state_checkpoint( ucImage, sizeof( ucImage ) );
+	xSaved = xProbeContext;
+
+	if( ( xLength == 0 ) || ( stop_state_machine( xProbe ) != true ) )
+	{
+		return pdFAIL;
+	}
+
+	memset( &xProbeContext, 0, sizeof( xProbeContext ) );
+	xProbe = start_new_state_machine_restore( pxProbeMachine, ucImage, xLength );
+
+	if( ( state_call( xProbe, probePING, &ulReply, probeWAIT_TICKS ) != true ) || ( ulReply != eProbeBusy ) )
+	{
+		xReturn = pdFAIL;
+	}
+
+	xReturn &= prvProbeWaitHandled( 1 );
+
+	/* The ping was counted on top of the restored context. */
+	if( ( xProbeContext.ulWork != xSaved.ulWork ) || ( xProbeContext.ulSeen != xSaved.ulSeen + 1 ) )
+	{
+		xReturn = pdFAIL;
+	}
+
+	/* A corrupt image is refused, the probe then starts cold. */
+	if( stop_state_machine( xProbe ) != true )
+	{
+		return pdFAIL;
+	}
+
+	ucImage[ xLength - 1 ] ^= 0xFF;
+	xProbe = start_new_state_machine_restore( pxProbeMachine, ucImage, xLength );
+
+	if( ( state_call( xProbe, probePING, &ulReply, probeWAIT_TICKS ) != true ) || ( ulReply != eProbeIdle ) )
+	{
+		xReturn = pdFAIL;
+	}
+
+	xReturn &= prvProbeWaitHandled( 1 );
+
+	return xReturn;
+}
+
+/* A stopped probe is out of the registry and gets nothing posted meanwhile,
+a probe started again on the same definition works as before. */
+static BaseType_t prvStateCoreStop( state_init_s *pxProbeMachine )
+{
+state_handle_t xStopped = xProbe;
+const state_event_t xWork = probeWORK;
+uint32_t ulWork = xProbeContext.ulWork;
+state_stats_s xStats;
+BaseType_t xReturn = pdPASS;
+
+	if( stop_state_machine( xStopped ) != true )
+	{
+		return pdFAIL;
+	}
+
+	/* The handle is only looked up, never used, once it is stopped. */
+	if( ( stop_state_machine( xStopped ) != false ) || ( state_core_get_stats( xStopped, &xStats ) != false ) )
+	{
+		xReturn = pdFAIL;
+	}
+
+	/* Routed right here, before the probe is back. */
+	( void ) state_post_events( &xWork, 1 );
+
+	xProbe = start_new_state_machine( pxProbeMachine );
+	state_post_event( probeFIRE );
+
+	if( ( prvProbeWaitHandled( 1 ) != pdPASS ) || ( xProbeContext.ulWork != ulWork ) )
+	{
+		xReturn = pdFAIL;
+	}
+
+	return xReturn;
+}
+
+/* Only the subscribed namespace reaches the probe.  The event_multiplexer
+routes in order, so once the event after it is handled the one outside the
+subscriptions would have been too. */
+static BaseType_t prvStateCoreRouting( void )
+{
+uint32_t ulWork = xProbeContext.ulWork;
+uint32_t ulSeen = xProbeContext.ulSeen;
+BaseType_t xReturn = pdPASS;
+
+	state_post_event( probeOUTSIDE );
+	state_post_event( probeEVENT_START + STATE_NAMESPACE_SIZE - 1 );
+	state_post_event( probeWORK );
+
+	if( ( prvProbeWaitHandled( 2 ) != pdPASS ) || ( xProbeContext.ulSeen != ulSeen + 2 ) || ( xProbeContext.ulWork != ulWork + 1 ) )
+	{
+		xReturn = pdFAIL;
+	}
+
+	return xReturn;
+}
+
+/* A keyed event reaches the instance bound to its key only while the key is
+bound, stopping the instance unbinds its keys. */
+static BaseType_t prvStateCoreKeys( state_init_s *pxProbeMachine )
+{
+const uint32_t ulKey = probeKEY;
+uint32_t ulWork = xProbeContext.ulWork;
+BaseType_t xReturn = pdPASS;
+
+	if( state_bind_keys( &ulKey, &xProbe, 1 ) != true )
+	{
+		return pdFAIL;
+	}
+
+	if( ( state_post_keyed_event( ulKey, probeWORK ) != true ) || ( state_post_keyed_event( ulKey + 1, probeWORK ) != false ) )
+	{
+		xReturn = pdFAIL;
+	}
+
+	state_unbind_keys( &ulKey, 1 );
+
+	if( state_post_keyed_event( ulKey, probeWORK ) != false )
+	{
+		xReturn = pdFAIL;
+	}
+
+	if( ( prvProbeWaitHandled( 1 ) != pdPASS ) || ( xProbeContext.ulWork != ulWork + 1 ) )
+	{
+		xReturn = pdFAIL;
+	}
+
+	if( ( state_bind_keys( &ulKey, &xProbe, 1 ) != true ) || ( stop_state_machine( xProbe ) != true ) )
+	{
+		return pdFAIL;
+	}
+
+	xProbe = start_new_state_machine( pxProbeMachine );
+
+	if( state_post_keyed_event( ulKey, probeWORK ) != false )
+	{
+		xReturn = pdFAIL;
+	}
+
+	return xReturn;
+}
+
+/* Work posted while the probe is busy waits until it is idle again, events
+behind it are not held up. */
+static BaseType_t prvStateCoreDefer( void )
+{
+uint32_t ulWork = xProbeContext.ulWork;
+uint32_t ulFired = xProbeContext.ulFired;
+state_stats_s xStats;
+BaseType_t xReturn = pdPASS;
+
+	state_post_event( probeBUSY );
+	state_post_event( probeWORK );
+	state_post_event( probeFIRE );
+
+	if( ( prvProbeWaitHandled( 2 ) != pdPASS ) || ( xProbeContext.ulFired != ulFired + 1 ) || ( xProbeContext.ulWork != ulWork ) )
+	{
+		xReturn = pdFAIL;
+	}
+
+	/* Done, then the deferred work, in that order. */
+	state_post_event( probeDONE );
+
+	if( ( prvProbeWaitHandled( 2 ) != pdPASS ) || ( xProbeContext.ulWorkWhenDone != ulWork ) || ( xProbeContext.ulWork != ulWork + 1 ) )
+	{
+		xReturn = pdFAIL;
+	}
+
+	if( ( state_core_get_stats( xProbe, &xStats ) != true ) || ( xStats.deferred_events != 1 ) || ( xStats.defer_overflows != 0 ) )
+	{
+		xReturn = pdFAIL;
+	}
+
+	return xReturn;
+}
+
+/* Bus subscriber used by prvStateCoreBus().  It holds in next_state until
+xBusGate is open, so the bus fills up behind it, and gives xBusDone once it
+read busLAST.  Its events are outside the probe namespace. */
+#define busEVENT		( probeEVENT_START + ( 2 * STATE_NAMESPACE_SIZE ) )
+#define busLAST			( busEVENT + 1 )
+#define busWAIT_TICKS	pdMS_TO_TICKS( 20 )
+
+static SemaphoreHandle_t xBusGate = NULL;
+static SemaphoreHandle_t xBusDone = NULL;
+
+#if ( STATE_CORE_STATIC_ALLOCATION == 1 )
+	STATE_MACHINE_STATIC_STORAGE( bus_listener, 4096 );
+#endif
+
+static void prvBusNextState( state_t *pxState, state_event_t xEvent )
+{
+	( void ) pxState;
+
+	/* Taken and given back, the gate stays open once it was opened. */
+	xSemaphoreTake( xBusGate, portMAX_DELAY );
+	xSemaphoreGive( xBusGate );
+
+	if( xEvent == busLAST )
+	{
+		xSemaphoreGive( xBusDone );
+	}
+}
+
+static bool prvBusFilter( state_event_t xEvent )
+{
+	return ( xEvent == busEVENT ) || ( xEvent == busLAST );
+}
+
+/* A publisher waits for the slowest subscriber and gives up after its
+timeout, then publishes once the subscriber catches up. */
+static BaseType_t prvStateCoreBus( void )
+{
+static state_array_s xListenerTable[] =
+{
+	{ prvProbeWait, portMAX_DELAY },
+};
+static state_init_s xListenerMachine =
+{
+	.next_state        = prvBusNextState,
+	.translation_table = xListenerTable,
+	.event_print       = prvHarnessEventPrint,
+	.starting_state    = 0,
+	.state_name_string = "bus listener",
+	.filter_event      = prvBusFilter,
+	.total_states      = 1,
+	.bus_subscriber    = true,
+	#if ( STATE_CORE_STATIC_ALLOCATION == 1 )
+		STATE_MACHINE_STATIC_INIT( bus_listener ),
+	#endif
+};
+/* One more than fits while the listener holds on to the first event. */
+static state_event_t xBurst[ STATE_BUS_DEPTH + 2 ];
+const state_event_t xLast = busLAST;
+state_handle_t xListener;
+UBaseType_t uxEvent;
+BaseType_t xReturn = pdPASS;
+
+	if( xBusGate == NULL )
+	{
+		xBusGate = xSemaphoreCreateBinary();
+		xBusDone = xSemaphoreCreateBinary();
+		configASSERT( xBusGate && xBusDone );
+	}
+
+	for( uxEvent = 0; uxEvent < sizeof( xBurst ) / sizeof( xBurst[ 0 ] ); uxEvent++ )
+	{
+		xBurst[ uxEvent ] = busEVENT;
+	}
+
+	xListener = start_new_state_machine( &xListenerMachine );
+
+	if( state_bus_publish( xBurst, sizeof( xBurst ) / sizeof( xBurst[ 0 ] ), busWAIT_TICKS ) != false )
+	{
+		xReturn = pdFAIL;
+	}
+
+	xSemaphoreGive( xBusGate );
+
+	if( ( state_bus_publish( &xLast, 1, probeWAIT_TICKS ) != true ) ||
+		( xSemaphoreTake( xBusDone, probeWAIT_TICKS ) != pdTRUE ) )
+	{
+		xReturn = pdFAIL;
+	}
+
+	if( stop_state_machine( xListener ) != true )
+	{
+		xReturn = pdFAIL;
+	}
+
+	return xReturn;
+}
+
+#ifdef POSIX_FREERTOS_SIM
+
+/* Opens both sides of a bridge in this process, side 0 exporting
+probeBRIDGED.  The event comes back through side 1 as a remote event, so the
+probe handles it twice, and remote events are not forwarded again.  Bridges
+stay open for the life of the process, hence the static sides. */
+static BaseType_t prvStateCoreBridge( void )
+{
+static const state_range_s xExports[] =
+{
+	STATE_RANGE( probeBRIDGED, probeBRIDGED ),
+};
+static state_shm_bridge_s xSides[ 2 ];
+char cName[ STATE_SHM_MAX_NAME ];
+uint32_t ulBridged = xProbeContext.ulBridged;
+BaseType_t xReturn = pdPASS;
+
+	snprintf( cName, sizeof( cName ), "/state_core_test_%d", ( int ) getpid() );
+
+	if( ( state_shm_bridge_open( &xSides[ 0 ], cName, 0, xExports, 1 ) != true ) ||
+		( state_shm_bridge_open( &xSides[ 1 ], cName, 1, NULL, 0 ) != true ) )
+	{
+		shm_unlink( cName );
+		return pdFAIL;
+	}
+
+	/* Both sides are mapped, the name is no longer needed. */
+	shm_unlink( cName );
+
+	state_post_event( probeBRIDGED );
+
+	/* The tap runs before the event is delivered, so once the remote copy is
+	handled it would have been forwarded again already. */
+	if( ( prvProbeWaitHandled( 2 ) != pdPASS ) || ( xProbeContext.ulBridged != ulBridged + 2 ) ||
+		( xSides[ 0 ].forwarded != 1 ) || ( xSides[ 1 ].forwarded != 0 ) || ( xSides[ 0 ].dropped != 0 ) )
+	{
+		xReturn = pdFAIL;
+	}
+
+	return xReturn;
+}
+
+/* Polls until the ingress task read everything waiting on xSocket.  The
+ingress task has nothing to signal, so the checks poll what it leaves
+behind. */
+static BaseType_t prvIngressWaitDrained( int xSocket )
+{
+TickType_t xTicks;
+int xPending = 0;
+
+	for( xTicks = 0; xTicks < probeWAIT_TICKS; xTicks++ )
+	{
+		if( ( ioctl( xSocket, FIONREAD, &xPending ) == 0 ) && ( xPending == 0 ) )
+		{
+			return pdPASS;
+		}
+
+		vTaskDelay( 1 );
+	}
+
+	return pdFAIL;
+}
+
+/* Polls until the ingress stats counter at xOffset reaches ulTarget. */
+static BaseType_t prvIngressWaitStat( size_t xOffset, uint32_t ulTarget )
+{
+state_ingress_stats_s xStats;
+TickType_t xTicks;
+
+	for( xTicks = 0; xTicks < probeWAIT_TICKS; xTicks++ )
+	{
+		state_ingress_get_stats( &xStats );
+
+		if( *( uint32_t * ) ( ( uint8_t * ) &xStats + xOffset ) >= ulTarget )
+		{
+			return pdPASS;
+		}
+
+		vTaskDelay( 1 );
+	}
+
+	return pdFAIL;
+}
+
+/* Feeds the ingress over socket pairs.  A frame split across two reads is put
+back together, a frame over STATE_INGRESS_MAX_BATCH gets its client dropped,
+and clients that go away give their slot back. */
+static BaseType_t prvStateCoreIngress( void )
+{
+const uint32_t ulFrame[] = { 2, probeWORK, probeWORK };
+const uint32_t ulOversized = STATE_INGRESS_MAX_BATCH + 1;
+const size_t xSplit = sizeof( uint32_t ) + 2;
+static int xSpare[ STATE_INGRESS_MAX_CLIENTS + 1 ][ 2 ];
+char cPath[ 64 ];
+int xPair[ 2 ];
+uint32_t ulWork = xProbeContext.ulWork;
+state_ingress_stats_s xBefore;
+UBaseType_t uxClient;
+BaseType_t xReturn = pdPASS;
+
+	snprintf( cPath, sizeof( cPath ), "/tmp/state_core_test_%d.sock", ( int ) getpid() );
+
+	if( state_ingress_start( cPath ) != true )
+	{
+		return pdFAIL;
+	}
+
+	/* The clients come from socketpair(), nobody connects to the socket. */
+	unlink( cPath );
+	state_ingress_get_stats( &xBefore );
+
+	if( ( socketpair( AF_UNIX, SOCK_STREAM, 0, xPair ) != 0 ) || ( state_ingress_add_client( xPair[ 0 ] ) != true ) )
+	{
+		return pdFAIL;
+	}
+
+	( void ) send( xPair[ 1 ], ulFrame, xSplit, MSG_NOSIGNAL );
+	xReturn &= prvIngressWaitDrained( xPair[ 0 ] );
+	( void ) send( xPair[ 1 ], ( const uint8_t * ) ulFrame + xSplit, sizeof( ulFrame ) - xSplit, MSG_NOSIGNAL );
+
+	if( ( prvProbeWaitHandled( 2 ) != pdPASS ) || ( xProbeContext.ulWork != ulWork + 2 ) )
+	{
+		xReturn = pdFAIL;
+	}
+
+	close( xPair[ 1 ] );
+	xReturn &= prvIngressWaitStat( offsetof( state_ingress_stats_s, disconnects ), xBefore.disconnects + 1 );
+
+	if( ( socketpair( AF_UNIX, SOCK_STREAM, 0, xPair ) != 0 ) || ( state_ingress_add_client( xPair[ 0 ] ) != true ) )
+	{
+		return pdFAIL;
+	}
+
+	( void ) send( xPair[ 1 ], &ulOversized, sizeof( ulOversized ), MSG_NOSIGNAL );
+	xReturn &= prvIngressWaitStat( offsetof( state_ingress_stats_s, rejected ), xBefore.rejected + 1 );
+	close( xPair[ 1 ] );
+
+	/* Every slot is free again, and one client more than there are slots is
+	left to the caller. */
+	for( uxClient = 0; uxClient <= STATE_INGRESS_MAX_CLIENTS; uxClient++ )
+	{
+		if( socketpair( AF_UNIX, SOCK_STREAM, 0, xSpare[ uxClient ] ) != 0 )
+		{
+			return pdFAIL;
+		}
+
+		if( state_ingress_add_client( xSpare[ uxClient ][ 0 ] ) != ( uxClient < STATE_INGRESS_MAX_CLIENTS ) )
+		{
+			xReturn = pdFAIL;
+		}
+	}
+
+	close( xSpare[ STATE_INGRESS_MAX_CLIENTS ][ 0 ] );
+
+	for( uxClient = 0; uxClient <= STATE_INGRESS_MAX_CLIENTS; uxClient++ )
+	{
+		close( xSpare[ uxClient ][ 1 ] );
+	}
+
+	xReturn &= prvIngressWaitStat( offsetof( state_ingress_stats_s, disconnects ), xBefore.disconnects + 1 + STATE_INGRESS_MAX_CLIENTS );
+
+	if( prvIngressWaitStat( offsetof( state_ingress_stats_s, batches ), xBefore.batches + 1 ) != pdPASS )
+	{
+		xReturn = pdFAIL;
+	}
+
+	return xReturn;
+}
+
+/* More lines than the console ring holds, so each round must drop some. */
+#define consoleTEST_LINES		2048
+
+/* Prints ulLines numbered lines and flushes them into the pipe that stands in
+for stdout, then checks that what came out is lines 0 to *pulKept - 1 in
+order, followed by a drop count covering the rest. */
+static BaseType_t prvConsoleRingRound( int iPipe, uint32_t ulLines, uint32_t *pulKept )
+{
+static char cOutput[ 32768 ];
+char *pcLine, *pcSave;
+ssize_t xRead;
+size_t xFill = 0;
+unsigned uDropped = 0, uNumber;
+uint32_t ulLine;
+
+	for( ulLine = 0; ulLine < ulLines; ulLine++ )
+	{
+		console_print( "ring %u\n", ( unsigned ) ulLine );
+	}
+
+	console_log_flush();
+
+	while( xFill < sizeof( cOutput ) - 1 )
+	{
+		xRead = read( iPipe, &cOutput[ xFill ], sizeof( cOutput ) - 1 - xFill );
+
+		if( xRead <= 0 )
+		{
+			break;
+		}
+
+		xFill += ( size_t ) xRead;
+	}
+
+	cOutput[ xFill ] = '\0';
+	*pulKept = 0;
+
+	for( pcLine = strtok_r( cOutput, "\n", &pcSave ); pcLine != NULL; pcLine = strtok_r( NULL, "\n", &pcSave ) )
+	{
+		if( ( uDropped == 0 ) && ( sscanf( pcLine, "ring %u", &uNumber ) == 1 ) && ( uNumber == *pulKept ) )
+		{
+			( *pulKept )++;
+		}
+		else if( ( uDropped != 0 ) || ( sscanf( pcLine, "[console] %u log lines dropped", &uDropped ) != 1 ) )
+		{
+			return pdFAIL;
+		}
+	}
+
+	return ( *pulKept + uDropped == ulLines ) ? pdPASS : pdFAIL;
+}
+/*-----------------------------------------------------------*/
+
+/* Fills the console ring past capacity with the scheduler suspended, so the
+log task can't drain it, and stdout redirected to a pipe.  The first round
+leaves the ring part way through the array, so the second wraps around its
+end. */
+static BaseType_t prvConsoleRing( void )
+{
+int iPipe[ 2 ], iStdout;
+uint32_t ulKept;
+BaseType_t xReturn = pdPASS;
+
+	console_log_flush();
+	fflush( stdout );
+
+	if( pipe( iPipe ) != 0 )
+	{
+		return pdFAIL;
+	}
+
+	/* Neither a short read nor an overfull pipe may hang the test. */
+	fcntl( iPipe[ 0 ], F_SETFL, O_NONBLOCK );
+	fcntl( iPipe[ 1 ], F_SETFL, O_NONBLOCK );
+
+	iStdout = dup( STDOUT_FILENO );
+	vTaskSuspendAll();
+	dup2( iPipe[ 1 ], STDOUT_FILENO );
+
+	/* Everything fits, nothing is dropped. */
+	if( ( prvConsoleRingRound( iPipe[ 0 ], 3, &ulKept ) != pdPASS ) || ( ulKept != 3 ) )
+	{
+		xReturn = pdFAIL;
+	}
+
+	/* A full ring's worth is kept and the rest counted as dropped. */
+	if( ( prvConsoleRingRound( iPipe[ 0 ], consoleTEST_LINES, &ulKept ) != pdPASS ) ||
+		( ulKept == 0 ) || ( ulKept == consoleTEST_LINES ) )
+	{
+		xReturn = pdFAIL;
+	}
+
+	/* The next round starts from the slot the last one stopped at. */
+	if( ( prvConsoleRingRound( iPipe[ 0 ], consoleTEST_LINES, &ulKept ) != pdPASS ) ||
+		( ulKept == 0 ) || ( ulKept == consoleTEST_LINES ) )
+	{
+		xReturn = pdFAIL;
+	}
+
+	dup2( iStdout, STDOUT_FILENO );
+	xTaskResumeAll();
+
+	close( iStdout );
+	close( iPipe[ 0 ] );
+	close( iPipe[ 1 ] );
+
+	return xReturn;
+}
+/*-----------------------------------------------------------*/
+
+#endif /* POSIX_FREERTOS_SIM */
+
+static BaseType_t prvStateCore( void )
+{
+static state_array_s xProbeTable[ eProbeStates ] =
+{
+	{ prvProbeWait, portMAX_DELAY },
+	{ prvProbeWait, portMAX_DELAY, 0, STATE_DEFER_BIT( probeEVENT_START, probeWORK ) },
+};
+static const state_range_s xProbeSubscriptions[] =
+{
+	STATE_NAMESPACE( probeEVENT_START ),
+};
+static state_source_s xProbeSources[] =
+{
+	{ NULL, probeSOURCE_LENGTH, prvProbeSourceReady },
+};
+static state_init_s xProbeMachine =
+{
+	.next_state          = prvProbeNextState,
+	.translation_table   = xProbeTable,
+	.event_print         = prvHarnessEventPrint,
+	.starting_state      = eProbeIdle,
+	.state_name_string   = "probe",
+	.defer_event_base    = probeEVENT_START,
+	.flag_mask           = STATE_FLAG( 0 ) | STATE_FLAG( 1 ),
+	.sources             = xProbeSources,
+	.total_sources       = 1,
+	.subscriptions       = xProbeSubscriptions,
+	.total_subscriptions = 1,
+	.total_states        = eProbeStates,
+	.context             = &xProbeContext,
+	.context_size        = sizeof( xProbeContext ),
+	#if ( STATE_CORE_STATIC_ALLOCATION == 1 )
+		STATE_MACHINE_STATIC_INIT( probe ),
+		STATE_MACHINE_STATIC_MESSAGES_INIT( probe ),
+	#else
+		.message_buffer_size = probeMESSAGE_BUFFER,
+	#endif
+};
+BaseType_t xReturn = pdPASS;
+
+	if( xProbeHandled == NULL )
+	{
+		xProbeHandled = xSemaphoreCreateCounting( probeMAX_HANDLED, 0 );
+		xProbeSource = xQueueCreate( probeSOURCE_LENGTH, sizeof( uint32_t ) );
+		configASSERT( xProbeHandled && xProbeSource );
+	}
+
+	xProbeSources[ 0 ].handle = xProbeSource;
+
+	memset( &xProbeContext, 0, sizeof( xProbeContext ) );
+	xProbe = start_new_state_machine( &xProbeMachine );
+
+	/* The probe handles what is posted to it. */
+	state_post_event( probeWORK );
+
+	if( ( prvProbeWaitHandled( 1 ) != pdPASS ) || ( xProbeContext.ulWork != 1 ) )
+	{
+		xReturn = pdFAIL;
+	}
+
+	xReturn &= prvStateCoreFlags();
+	xReturn &= prvStateCoreSources();
+	xReturn &= prvStateCoreMessages();
+	xReturn &= prvStateCoreTimers();
+	xReturn &= prvStateCoreCalls();
+	xReturn &= prvStateCoreCheckpoint( &xProbeMachine );
+	xReturn &= prvStateCoreStop( &xProbeMachine );
+	xReturn &= prvStateCoreRouting();
+	xReturn &= prvStateCoreKeys( &xProbeMachine );
+	xReturn &= prvStateCoreDefer();
+	xReturn &= prvStateCoreBus();
+
+	#ifdef POSIX_FREERTOS_SIM
+	{
+		xReturn &= prvStateCoreBridge();
+		xReturn &= prvStateCoreIngress();
+	}
+	#endif
+
+	return xReturn;
+}
+/*-----------------------------------------------------------*/
+
+BaseType_t xRunStateCoreTests( void )
+{
+BaseType_t xReturn = pdPASS;
+
+	xReturn &= prvStateHarness();
+	xReturn &= prvStateFleet();
+	xReturn &= prvStateCore();
+
+	#ifdef POSIX_FREERTOS_SIM
+	{
+		xReturn &= prvConsoleRing();
+	}
+	#endif
+
+	return xReturn;
+}
+/*-----------------------------------------------------------*/
+
 BaseType_t xRunCodeCoverageTestAdditions( void )
 {
 BaseType_t xReturn = pdPASS;
@@ -607,6 +1788,7 @@ BaseType_t xReturn = pdPASS;
 	xReturn &= prvTaskQueryFunctions();
 	xReturn &= prvTaskTags();
 	xReturn &= prvTimerQuery();
+	xReturn &= xRunStateCoreTests();
 
 	return xReturn;
 }
@@ -30,16 +30,65 @@
 
 #include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
 
 #include <FreeRTOS.h>
-#include <semphr.h>
+#include <task.h>
 
-SemaphoreHandle_t xStdioMutex;
-StaticSemaphore_t xStdioMutexBuffer;
+#include "console.h"
+
+/* Each log line takes one slot of the ring, longer lines are truncated. */
+#define consoleLOG_SLOT_SIZE        256
+#define consoleLOG_SLOTS            512     /* Power of two. */
+#define consoleLOG_BATCH_SIZE       16384   /* Bytes handed to one write(). */
+#define consoleLOG_DRAIN_PERIOD_MS  10
+#define consoleLOG_FLUSH_WAIT_MS    100     /* Longest console_log_flush() waits for the log task. */
+#define consoleLOG_TASK_STACK_SIZE  ( configMINIMAL_STACK_SIZE * 4 )
+
+/* Above the application tasks, so a busy application can't starve the log.
+The task sleeps whenever the ring is empty. */
+#define consoleLOG_TASK_PRIORITY    ( configMAX_PRIORITIES - 2 )
+
+/* Outcomes of prvConsoleDrain(). */
+#define consoleDRAIN_EMPTY          0
+#define consoleDRAIN_WROTE          1
+#define consoleDRAIN_BUSY           2       /* Another task is draining. */
+
+/* A slot is free for the writer claiming position n when its turn is n, and
+holds a line for the reader at position n when its turn is n + 1.  The turn
+is stored minus the slot index so that the zero initialised ring is empty,
+which lets console_print() be used before console_init(). */
+typedef struct
+{
+    volatile uint32_t ulTurn;
+    uint32_t ulLength;
+    char cText[ consoleLOG_SLOT_SIZE - 2 * sizeof( uint32_t ) ];
+} LogSlot_t;
+
+static LogSlot_t xLogRing[ consoleLOG_SLOTS ];
+static volatile uint32_t ulLogHead;      /* Next position claimed by a writer. */
+static uint32_t ulLogTail;               /* Next position the reader takes. */
+static volatile uint32_t ulLogDropped;   /* Lines lost to a full ring. */
+static volatile uint32_t ulLogReaderBusy;
+
+static StaticTask_t xLogTaskBuffer;
+static StackType_t uxLogTaskStack[ consoleLOG_TASK_STACK_SIZE ];
+static char cLogBatch[ consoleLOG_BATCH_SIZE ];
+
+static void prvConsoleLogTask( void *pvParameters );
+static BaseType_t prvConsoleDrain( void );
+/*-----------------------------------------------------------*/
 
 void console_init(void)
 {
-    xStdioMutex = xSemaphoreCreateMutexStatic(&xStdioMutexBuffer);
+    xTaskCreateStatic( prvConsoleLogTask, "console_log", consoleLOG_TASK_STACK_SIZE, NULL,
+                       consoleLOG_TASK_PRIORITY, uxLogTaskStack, &xLogTaskBuffer );
+
+    /* Lines logged at exit, e.g. the state_core statistics, still make it out. */
+    atexit( console_log_flush );
 }
 
 void console_print(const char *fmt, ...)
@@ -47,12 +96,174 @@ void console_print(const char *fmt, ...)
     va_list vargs;
 
     va_start(vargs, fmt);
-    
-    xSemaphoreTake(xStdioMutex, portMAX_DELAY);
+    console_vlog(fmt, vargs);
+    va_end(vargs);
+}
 
-    vprintf(fmt, vargs);
+void console_vlog(const char *fmt, va_list vargs)
+{
+    char cLine[ sizeof( xLogRing[ 0 ].cText ) ];
+    int iLength;
+    uint32_t ulPosition;
+    LogSlot_t *pxSlot;
 
-    xSemaphoreGive(xStdioMutex);
+    /* Format on the caller's stack, before claiming a slot, so the slot is
+    only held for a copy. */
+    iLength = vsnprintf( cLine, sizeof( cLine ), fmt, vargs );
+    if( iLength < 0 )
+    {
+        return;
+    }
+    if( iLength >= ( int ) sizeof( cLine ) )
+    {
+        iLength = sizeof( cLine ) - 1;
+        cLine[ iLength - 1 ] = '\n';
+    }
 
-    va_end(vargs);
+    ulPosition = __atomic_load_n( &ulLogHead, __ATOMIC_RELAXED );
+    for( ;; )
+    {
+        pxSlot = &xLogRing[ ulPosition % consoleLOG_SLOTS ];
+        int32_t lDiff = ( int32_t ) ( __atomic_load_n( &pxSlot->ulTurn, __ATOMIC_ACQUIRE ) + ( ulPosition % consoleLOG_SLOTS ) - ulPosition );
+
+        if( lDiff == 0 )
+        {
+            if( __atomic_compare_exchange_n( &ulLogHead, &ulPosition, ulPosition + 1, pdTRUE, __ATOMIC_RELAXED, __ATOMIC_RELAXED ) )
+            {
+                break;
+            }
+        }
+        else if( lDiff < 0 )
+        {
+            /* The ring is full, losing the line beats blocking the caller. */
+            __atomic_fetch_add( &ulLogDropped, 1, __ATOMIC_RELAXED );
+            return;
+        }
+        else
+        {
+            ulPosition = __atomic_load_n( &ulLogHead, __ATOMIC_RELAXED );
+        }
+    }
+
+    memcpy( pxSlot->cText, cLine, iLength );
+    pxSlot->ulLength = iLength;
+    __atomic_store_n( &pxSlot->ulTurn, ulPosition + 1 - ( ulPosition % consoleLOG_SLOTS ), __ATOMIC_RELEASE );
+}
+
+/* Writes out everything logged so far from the calling task, e.g. before an
+abort().  If the log task is in the middle of a drain it is given time to
+finish, for at most consoleLOG_FLUSH_WAIT_MS (it can't progress while the
+scheduler is suspended). */
+void console_log_flush(void)
+{
+    BaseType_t xResult;
+    uint32_t ulWaited = 0;
+
+    for( ;; )
+    {
+        xResult = prvConsoleDrain();
+
+        if( xResult == consoleDRAIN_EMPTY )
+        {
+            break;
+        }
+
+        if( xResult == consoleDRAIN_BUSY )
+        {
+            if( ulWaited++ == consoleLOG_FLUSH_WAIT_MS )
+            {
+                break;
+            }
+
+            if( xTaskGetSchedulerState() == taskSCHEDULER_RUNNING )
+            {
+                vTaskDelay( pdMS_TO_TICKS( 1 ) );
+            }
+            else
+            {
+                usleep( 1000 );
+            }
+        }
+    }
+}
+/*-----------------------------------------------------------*/
+
+static void prvWriteAll( const char *pcBuffer, size_t xLength )
+{
+    while( xLength > 0 )
+    {
+        ssize_t xWritten = write( STDOUT_FILENO, pcBuffer, xLength );
+
+        if( xWritten < 0 )
+        {
+            /* The simulator's tick signal interrupts system calls. */
+            if( errno == EINTR )
+            {
+                continue;
+            }
+            return;
+        }
+
+        pcBuffer += xWritten;
+        xLength -= xWritten;
+    }
+}
+
+/* Gathers the ready lines into one batch and writes it with a single write()
+call.  Returns consoleDRAIN_WROTE if anything was written. */
+static BaseType_t prvConsoleDrain( void )
+{
+    size_t xFill = 0;
+    uint32_t ulDropped;
+
+    if( __atomic_exchange_n( &ulLogReaderBusy, 1, __ATOMIC_ACQUIRE ) != 0 )
+    {
+        return consoleDRAIN_BUSY;
+    }
+
+    /* stdout may still hold lines printed with printf(), keep them first. */
+    fflush( stdout );
+
+    for( ;; )
+    {
+        LogSlot_t *pxSlot = &xLogRing[ ulLogTail % consoleLOG_SLOTS ];
+        uint32_t ulTurn = __atomic_load_n( &pxSlot->ulTurn, __ATOMIC_ACQUIRE ) + ( ulLogTail % consoleLOG_SLOTS );
+
+        if( ( ulTurn != ulLogTail + 1 ) || ( xFill + pxSlot->ulLength > sizeof( cLogBatch ) ) )
+        {
+            break;
+        }
+
+        memcpy( &cLogBatch[ xFill ], pxSlot->cText, pxSlot->ulLength );
+        xFill += pxSlot->ulLength;
+
+        /* Hand the slot back to the writer one lap ahead. */
+        __atomic_store_n( &pxSlot->ulTurn, ulLogTail + consoleLOG_SLOTS - ( ulLogTail % consoleLOG_SLOTS ), __ATOMIC_RELEASE );
+        ulLogTail++;
+    }
+
+    ulDropped = __atomic_exchange_n( &ulLogDropped, 0, __ATOMIC_RELAXED );
+    if( ( ulDropped != 0 ) && ( xFill + 64 <= sizeof( cLogBatch ) ) )
+    {
+        xFill += snprintf( &cLogBatch[ xFill ], 64, "[console] %u log lines dropped\n", ( unsigned ) ulDropped );
+    }
+
+    prvWriteAll( cLogBatch, xFill );
+    __atomic_store_n( &ulLogReaderBusy, 0, __ATOMIC_RELEASE );
+
+    return ( xFill != 0 ) ? consoleDRAIN_WROTE : consoleDRAIN_EMPTY;
+}
+/*-----------------------------------------------------------*/
+
+static void prvConsoleLogTask( void *pvParameters )
+{
+    ( void ) pvParameters;
+
+    for( ;; )
+    {
+        if( prvConsoleDrain() != consoleDRAIN_WROTE )
+        {
+            vTaskDelay( pdMS_TO_TICKS( consoleLOG_DRAIN_PERIOD_MS ) );
+        }
+    }
 }
@@ -27,6 +27,8 @@
 #ifndef CONSOLE_H
 #define CONSOLE_H
 
+#include <stdarg.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -35,8 +37,13 @@ extern "C" {
  * Example console I/O wrappers.
  *----------------------------------------------------------*/
 
+/* console_print() never blocks: the line is formatted by the caller, queued
+in a lock-free ring, and written out in batches by a log task.  Lines are
+dropped (and counted) if the ring is full. */
 void console_init(void);
 void console_print(const char *fmt, ...);
+void console_vlog(const char *fmt, va_list vargs);
+void console_log_flush(void);
 
 #ifdef __cplusplus
 }
@@ -1,5 +1,7 @@
 #pragma once
 
+#include "console.h"
+
 /**********************************************************
 *                                                 DEFINES *
 **********************************************************/
@@ -20,6 +22,7 @@
      do {                                                                \
          if (!(x)) {                                                     \
              ESP_LOGE(TAG, "ASSERT! error %s %u\n", __FILE__, __LINE__); \
+             console_log_flush();                                        \
             abort();                                                     \
          }                                                               \
      } while (0)
@@ -36,9 +39,10 @@
 #define FALSE (0)
 
 #ifdef POSIX_FREERTOS_SIM
- #define ESP_LOGE( tag, format, ... ) printf(format, ##__VA_ARGS__); printf("\n")
- #define ESP_LOGI( tag, format, ... ) printf(format, ##__VA_ARGS__); printf("\n")
- #define ESP_LOGW( tag, format, ... ) printf(format, ##__VA_ARGS__); printf("\n")
+ // Logging never blocks the caller, see console_print()
+ #define ESP_LOGE( tag, format, ... ) console_print(format "\n", ##__VA_ARGS__)
+ #define ESP_LOGI( tag, format, ... ) console_print(format "\n", ##__VA_ARGS__)
+ #define ESP_LOGW( tag, format, ... ) console_print(format "\n", ##__VA_ARGS__)
 #endif 
 
 /**********************************************************
@@ -55,6 +55,7 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <stdarg.h>
+#include <signal.h>
 
 /* FreeRTOS kernel includes. */
 #include "FreeRTOS.h"
@@ -62,6 +63,7 @@
 
 /* Local includes. */
 #include "console.h"
+#include "state_core.h"
 
 #define    BLINKY_DEMO       0
 #define    FULL_DEMO         1
@@ -74,7 +76,24 @@
 extern void main_blinky( void );
 extern void main_full( void );
 extern void main_tcp_echo_client_tasks( void );
+extern BaseType_t xRunCodeCoverageTestAdditions( void );
+extern BaseType_t xRunStateCoreTests( void );
 static void traceOnEnter( void );
+
+#if ( projCOVERAGE_TEST == 1 ) || ( projSTATE_SELF_TEST == 1 )
+/*
+ * Runs the checks of code_coverage_additions.c once the scheduler is up, and
+ * reports whether they passed.  The state_core checks start machines of their
+ * own next to the demo, so they only run when projSTATE_SELF_TEST is set to 1.
+ */
+static void prvSelfTestTask( void *pvParameters );
+#endif
+
+/*
+ * Asks the idle task to print the state_core reports and exit, a second
+ * Ctrl+C kills the process right away.
+ */
+static void prvExitRequested( int iSignal );
 /*
  * Only the comprehensive demo uses application hook (callback) functions.  See
  * http://www.freertos.org/a00016.html for more information.
@@ -104,6 +123,14 @@ void vApplicationGetTimerTaskMemory( StaticTask_t **ppxTimerTaskTCBBuffer,
  */
 static void prvSaveTraceFile( void );
 
+#if ( configUSE_VIRTUAL_TIME == 1 )
+/*
+ * Jumps the tick count forward to the deadline last reported by
+ * vVirtualTimeSuppressTicks().  Returns pdTRUE if any ticks were caught up.
+ */
+static BaseType_t prvVirtualTimeAdvance( void );
+#endif
+
 /*-----------------------------------------------------------*/
 
 /* When configSUPPORT_STATIC_ALLOCATION is set to 1 the application writer can
@@ -116,6 +143,15 @@ StackType_t uxTimerTaskStack[ configTIMER_TASK_STACK_DEPTH ];
 /* Notes if the trace is running or not. */
 static BaseType_t xTraceRunning = pdTRUE;
 
+/* Set by prvExitRequested(), acted on by the idle task. */
+static volatile sig_atomic_t xExitRequested = 0;
+
+#if ( configUSE_VIRTUAL_TIME == 1 )
+/* The tick on which the next blocked task is due to unblock, as last reported
+by the idle task, or portMAX_DELAY if there is nothing to jump to. */
+static volatile TickType_t xVirtualTimeTarget = portMAX_DELAY;
+#endif
+
 /*-----------------------------------------------------------*/
 
 int main( void )
@@ -134,11 +170,18 @@ int main( void )
     }
 
     console_init();
+    signal( SIGINT, prvExitRequested );
     //main_full();
     
     extern void test_init();
     test_init();
 
+    #if ( projCOVERAGE_TEST == 1 ) || ( projSTATE_SELF_TEST == 1 )
+    {
+        xTaskCreate( prvSelfTestTask, "self_test", configMINIMAL_STACK_SIZE * 4, NULL, tskIDLE_PRIORITY + 1, NULL );
+    }
+    #endif
+
     vTaskStartScheduler();
     return 0;
 }
@@ -174,8 +217,21 @@ void vApplicationIdleHook( void )
     because it is the responsibility of the idle task to clean up memory
     allocated by the kernel to any task that has since deleted itself. */
 
-
-    usleep(15000);
+    #if ( configUSE_VIRTUAL_TIME == 1 )
+    {
+        /* Every task is blocked, so rather than sleeping through the wait jump
+        straight to the next deadline.  Only sleep when there is no deadline to
+        jump to, e.g. all tasks are waiting on events with portMAX_DELAY. */
+        if( prvVirtualTimeAdvance() == pdFALSE )
+        {
+            usleep(15000);
+        }
+    }
+    #else
+    {
+        usleep(15000);
+    }
+    #endif
     traceOnEnter();
 
     #if ( mainSELECTED_APPLICATION == FULL_DEMO )
@@ -218,9 +274,74 @@ void vApplicationTickHook( void )
     #endif /* mainSELECTED_APPLICATION */
 }
 
+#if ( configUSE_VIRTUAL_TIME == 1 )
+
+void vVirtualTimeSuppressTicks( uint32_t ulExpectedIdleTime )
+{
+TickType_t xTarget;
+
+    /* Called from the idle task through portSUPPRESS_TICKS_AND_SLEEP() with
+    the scheduler suspended, so ticks cannot be caught up here.  Just record
+    the deadline, the idle hook performs the jump on its next iteration. */
+    xTarget = xTaskGetTickCount() + ( TickType_t ) ulExpectedIdleTime;
+
+    /* An empty delayed list reports portMAX_DELAY as the next unblock time,
+    in which case there is nothing to jump to. */
+    xVirtualTimeTarget = xTarget;
+}
+/*-----------------------------------------------------------*/
+
+static BaseType_t prvVirtualTimeAdvance( void )
+{
+TickType_t xTarget = xVirtualTimeTarget;
+TickType_t xToCatchUp;
+
+    xVirtualTimeTarget = portMAX_DELAY;
+
+    if( xTarget == portMAX_DELAY )
+    {
+        return pdFALSE;
+    }
+
+    /* Real ticks keep arriving while the idle task runs, so the deadline may
+    already be closer than when it was recorded, or have passed.  Never step
+    beyond it, otherwise tasks would unblock late and out of order. */
+    xToCatchUp = xTarget - xTaskGetTickCount();
+
+    if( ( xToCatchUp == 0 ) || ( xToCatchUp > ( portMAX_DELAY >> 1 ) ) )
+    {
+        return pdFALSE;
+    }
+
+    ( void ) xTaskCatchUpTicks( xToCatchUp );
+    return pdTRUE;
+}
+/*-----------------------------------------------------------*/
+
+#endif /* configUSE_VIRTUAL_TIME */
+
+static void prvExitRequested( int iSignal )
+{
+    xExitRequested = 1;
+    signal( iSignal, SIG_DFL );
+}
+/*-----------------------------------------------------------*/
+
 void traceOnEnter()
 {
     int ret;
+
+    if( xExitRequested != 0 )
+    {
+        /* Freeze every other task where it is, the reports then walk
+        state_core without its locks.  exit() runs the atexit() handlers,
+        which flush the console and the journal. */
+        vTaskSuspendAll();
+        state_core_dump_stats();
+        state_core_stack_report();
+        exit( 0 );
+    }
+
     struct timeval tv = { 0L, 0L };
     fd_set fds;
     FD_ZERO(&fds);
@@ -238,6 +359,33 @@ void traceOnEnter()
     }
 }
 
+#if ( projCOVERAGE_TEST == 1 ) || ( projSTATE_SELF_TEST == 1 )
+
+static void prvSelfTestTask( void *pvParameters )
+{
+BaseType_t xResult;
+
+    ( void ) pvParameters;
+
+    #if ( projCOVERAGE_TEST == 1 )
+    {
+        xResult = xRunCodeCoverageTestAdditions();
+    }
+    #else
+    {
+        /* The rest of the additions hit configASSERT() on purpose, so they
+        only run in the code coverage build. */
+        xResult = xRunStateCoreTests();
+    }
+    #endif
+
+    console_print( "Self test %s\n", ( xResult == pdPASS ) ? "PASSED" : "FAILED" );
+    vTaskDelete( NULL );
+}
+/*-----------------------------------------------------------*/
+
+#endif /* ( projCOVERAGE_TEST == 1 ) || ( projSTATE_SELF_TEST == 1 ) */
+
 void vLoggingPrintf( const char *pcFormat,
                      ... )
 {
@@ -9,33 +9,540 @@
 
 #include "global_defines.h"
 #include "state_core.h"
+#include "state_journal.h"
 #include "global_defines.h" 
 
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#if (configTASK_NOTIFICATION_ARRAY_ENTRIES <= STATE_FLAG_NOTIFY_INDEX)
+#error "configTASK_NOTIFICATION_ARRAY_ENTRIES must cover STATE_FLAG_NOTIFY_INDEX"
+#endif
+
 /**********************************************************
 *                                        GLOBAL VARIABLES *
 **********************************************************/
 
+/**********************************************************
+*                                                 DEFINES *
+**********************************************************/
+// Posted to the event_multiplexer to make it re-evaluate its timeout
+#define STATE_WAKE_EVENT (0xFFFFFFFE)
+
+// Posted to a state machine being stopped, see stop_state_machine()
+#define STATE_STOP_EVENT (0xFFFFFFFD)
+
+// Marks events posted with state_post_remote_event(), they are not handed to
+// the event taps so they never travel back to where they came from
+#define STATE_REMOTE_EVENT_FLAG (0x80000000)
+
 /**********************************************************
 *                                                TYPEDEFS *
 **********************************************************/
-typedef struct node {
-    struct node*  next;
-    state_init_s* thread_info;
+typedef struct state_node {
+    struct state_node* next;
+    state_init_s* thread_info; // Definition, shared by every instance
+    int           slot;        // Routing slot, see slot_nodes
+    bool          selective;   // Some state of the table limits its namespaces
+    int           total_keys;  // Keys bound to the instance, see key_table
+
+    // Sequence of the next broadcast bus event to read, and whether the
+    // machine is about to block with nothing left to read on the bus
+    volatile uint32_t bus_cursor;
+    volatile uint32_t bus_sleeping;
+
+    // Runtime of the state machine instance
+    state_t       state;
+    QueueHandle_t queue;
+    void*         context;
+    TaskHandle_t  task;
+    uint32_t      stack_depth;
+
+    // Machines with flags or sources wait on a queue set holding their event
+    // queue, their sources and a doorbell, which is given whenever flags are
+    // posted to them. The flags themselves are set in the task notification
+    // value.
+    QueueSetHandle_t  set;
+    SemaphoreHandle_t doorbell;
+    uint32_t          pending_flags;
+
+    // Call slot + 1 of the state_call() being handled, 0 if none
+    uint32_t          active_call;
+
+    // Events waiting for room in the event queue, oldest at overflow_head.
+    // Only touched by the event_multiplexer holding consumer_sem, the machine
+    // reads overflow_count to know it should wake the event_multiplexer.
+    state_event_t     overflow[STATE_OVERFLOW_DEPTH];
+    uint32_t          overflow_head;
+    volatile uint32_t overflow_count;
+
+    // Events deferred by the states the machine went through, oldest at
+    // defer_head. defer_replay of them are delivered again before reading
+    // new events. Only touched by the machine task.
+    state_event_t     deferred[STATE_DEFER_DEPTH];
+    uint32_t          defer_head;
+    uint32_t          defer_count;
+    uint32_t          defer_replay;
+
+    // Task waiting in stop_state_machine(), woken once the machine is parked
+    TaskHandle_t      stopper;
+    volatile bool     parked;
+
+    // Variable length messages, senders serialize on message_sem. The message
+    // being handled is received into message_rx, and lent to next_state
+    // through state_message_payload() while message_active is set.
+    MessageBufferHandle_t messages;
+    SemaphoreHandle_t     message_sem;
+    bool                  message_active;
+    uint8_t               message_rx[sizeof(state_msg_hdr_s) + STATE_MSG_MAX_PAYLOAD];
+
+    // Time-in-state accounting, entered_* are taken when the current state
+    // was entered
+    state_stats_s stats;
+    unsigned long entered_wall_ns;
+    uint32_t      entered_cpu_ns;
 } node_t;
 
+// A state_call() in flight
+typedef enum {
+    CALL_FREE,
+    CALL_PENDING,   // Caller is waiting for the reply
+    CALL_REPLIED,   // Reply written, caller frees the slot
+    CALL_ABANDONED, // Caller timed out, the target frees the slot
+    CALL_REFUSED,   // Target was stopped, caller frees the slot
+} call_status_e;
+
+typedef struct {
+    call_status_e status;
+    TaskHandle_t  caller;
+    uint32_t*     reply;
+} call_slot_t;
+
+// An event waiting to be posted by the event_multiplexer
+typedef struct {
+    TickType_t    deadline;
+    state_event_t event;
+    uint16_t      generation; // Bumped each time the slot is reused, makes stale handles miss
+    int16_t       heap_index; // Position in timer_heap, -1 when the slot is free
+} timed_event_t;
+
 /**********************************************************
 *                                        STATIC VARIABLES *
 **********************************************************/
 static const char        TAG[] = "STATE_CORE";
-static QueueSetHandle_t  incoming_events_q;
+static QueueHandle_t     incoming_events_q;
 static node_t*           head;
 static SemaphoreHandle_t consumer_sem;
+static TaskHandle_t      multiplexer_task;
+static volatile uint32_t multiplexer_wake_pending; // STATE_WAKE_EVENT is queued
+
+// Delayed events, timer_heap is a binary min-heap of slots ordered by deadline
+static SemaphoreHandle_t timer_sem;
+static timed_event_t     timed_events[STATE_MAX_TIMED_EVENTS];
+static uint8_t           timer_heap[STATE_MAX_TIMED_EVENTS];
+static int               timer_heap_len;
+
+// Routing, every machine holds a slot. The boundaries of all subscribed ranges
+// split the events into segments, route_masks[i] holds the slots subscribed
+// to [route_bounds[i], route_bounds[i + 1]). Machines without subscriptions
+// are in filter_slots and see every event. Only changed holding consumer_sem.
+#define ROUTE_MASK_WORDS (STATE_ROUTE_MAX_SLOTS / 32)
+
+static node_t*           slot_nodes[STATE_ROUTE_MAX_SLOTS];
+static uint32_t          used_slots[ROUTE_MASK_WORDS];
+static uint32_t          filter_slots[ROUTE_MASK_WORDS];
+static uint32_t          overflow_slots[ROUTE_MASK_WORDS]; // Machines with events in their overflow ring
+// Machines whose states limit the namespaces they accept are in
+// selective_slots once running, route_accepts[n] holds the ones whose current
+// state accepts namespace n. Both are updated by the machine tasks with
+// atomics, as they change state.
+static uint32_t          selective_slots[ROUTE_MASK_WORDS];
+static uint32_t          route_accepts[STATE_MAX_NAMESPACES][ROUTE_MASK_WORDS];
+static const uint32_t    route_none[ROUTE_MASK_WORDS];
+static state_event_t     route_bounds[STATE_ROUTE_MAX_SEGMENTS + 1];
+static int               route_total_bounds;
+static uint32_t          route_masks[STATE_ROUTE_MAX_SEGMENTS][ROUTE_MASK_WORDS];
+
+// Broadcast bus. Events are published into bus_ring at sequence bus_head, and
+// each subscriber reads them in place, advancing its own bus_cursor. The
+// publisher only waits when the slowest cursor is a whole ring behind.
+// bus_sem serializes publishers and guards bus_slots / bus_nodes. It is never
+// taken holding consumer_sem, and publishers let go of it while they wait.
+static state_event_t     bus_ring[STATE_BUS_DEPTH];
+static volatile uint32_t bus_head;
+static uint32_t          bus_gate;          // Slowest cursor, as last computed
+static volatile uint32_t bus_waiting;       // Publisher waits on bus_space
+static uint32_t          bus_slots[ROUTE_MASK_WORDS];
+static node_t*           bus_nodes[STATE_ROUTE_MAX_SLOTS];
+static SemaphoreHandle_t bus_sem;
+static SemaphoreHandle_t bus_space;
+
+// Keyed events, open addressing with linear probing from key -> instance.
+// An entry with a NULL node is empty. Only used holding consumer_sem.
+typedef struct {
+    uint32_t key;
+    node_t*  node;
+} key_entry_t;
+
+static key_entry_t       key_table[STATE_KEY_TABLE_SIZE];
+static int               keys_bound;
+
+// Event taps, only used holding consumer_sem
+typedef struct {
+    const state_range_s* ranges;
+    int                  total_ranges;
+    state_tap_f          tap;
+    void*                arg;
+} event_tap_t;
+
+static event_tap_t       taps[STATE_MAX_TAPS];
+static int               total_taps;
+
+// Calls in flight, slots are only changed inside critical sections
+static call_slot_t       call_slots[STATE_MAX_CALLS];
+
+#if (STATE_CORE_STATIC_ALLOCATION == 1)
+static node_t            node_pool[STATE_CORE_MAX_MACHINES];
+static int               nodes_used;
+static node_t*           free_nodes; // Nodes of stopped machines, linked through next
+static uint8_t           incoming_events_storage[EVENT_QUEUE_MAX_DEPTH * sizeof(state_event_t)];
+static StaticQueue_t     incoming_events_buffer;
+static StaticSemaphore_t consumer_sem_buffer;
+static StaticSemaphore_t timer_sem_buffer;
+static StaticSemaphore_t bus_sem_buffer;
+static StaticSemaphore_t bus_space_buffer;
+static StaticTask_t      multiplexer_task_buffer;
+static StackType_t       multiplexer_stack[STATE_MULTIPLEXER_STACK_DEPTH];
+#endif
 
 /**********************************************************
 *                                               FUNCTIONS *
 **********************************************************/
 
-void add_event_consumer(state_init_s* thread_info) {
+// Index of the last boundary at or below event, -1 if there is none
+static int route_find(state_event_t event) {
+    int low  = 0;
+    int high = route_total_bounds;
+
+    while (low < high) {
+        int mid = (low + high) / 2;
+        if (route_bounds[mid] <= event) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low - 1;
+}
+
+static void route_add_bound(state_event_t bound) {
+    int at = route_find(bound);
+    if (at >= 0 && route_bounds[at] == bound) {
+        return;
+    }
+
+    if (route_total_bounds == STATE_ROUTE_MAX_SEGMENTS + 1) {
+        ESP_LOGE(TAG, "Out of routing segments, raise STATE_ROUTE_MAX_SEGMENTS!");
+        ASSERT(0);
+    }
+
+    memmove(&route_bounds[at + 2], &route_bounds[at + 1], (route_total_bounds - at - 1) * sizeof(state_event_t));
+    route_bounds[at + 1] = bound;
+    route_total_bounds++;
+}
+
+// Rebuilds the interval index from the subscriptions of every machine
+static void route_rebuild() {
+    route_total_bounds = 0;
+    for (int slot = 0; slot < STATE_ROUTE_MAX_SLOTS; slot++) {
+        state_init_s* state_ptr = slot_nodes[slot] ? slot_nodes[slot]->thread_info : NULL;
+        for (int i = 0; state_ptr && i < state_ptr->total_subscriptions; i++) {
+            route_add_bound(state_ptr->subscriptions[i].first);
+            route_add_bound(state_ptr->subscriptions[i].last + 1);
+        }
+    }
+
+    memset(route_masks, 0, sizeof(route_masks));
+    for (int slot = 0; slot < STATE_ROUTE_MAX_SLOTS; slot++) {
+        state_init_s* state_ptr = slot_nodes[slot] ? slot_nodes[slot]->thread_info : NULL;
+        for (int i = 0; state_ptr && i < state_ptr->total_subscriptions; i++) {
+            const state_range_s* range = &state_ptr->subscriptions[i];
+            for (int segment = route_find(range->first); route_bounds[segment] <= range->last; segment++) {
+                route_masks[segment][slot / 32] |= 1u << (slot % 32);
+            }
+        }
+    }
+}
+
+// Gives a node a routing slot, must be called holding consumer_sem
+static void route_add(node_t* node) {
+    int slot = 0;
+    while (slot < STATE_ROUTE_MAX_SLOTS && (used_slots[slot / 32] & (1u << (slot % 32)))) {
+        slot++;
+    }
+    if (slot == STATE_ROUTE_MAX_SLOTS) {
+        ESP_LOGE(TAG, "Out of routing slots, raise STATE_ROUTE_MAX_SLOTS!");
+        ASSERT(0);
+    }
+
+    node->slot       = slot;
+    slot_nodes[slot] = node;
+    used_slots[slot / 32] |= 1u << (slot % 32);
+
+    for (int state = 0; state < node->thread_info->total_states; state++) {
+        node->selective |= node->thread_info->translation_table[state].namespaces != 0;
+    }
+
+    if (node->thread_info->total_subscriptions) {
+        route_rebuild();
+    } else {
+        filter_slots[slot / 32] |= 1u << (slot % 32);
+    }
+}
+
+// Stops routing events to a node, must be called holding consumer_sem. The
+// slot stays taken until route_release(), as the machine task may still
+// update its acceptance until it is parked.
+static void route_remove(node_t* node) {
+    int slot = node->slot;
+
+    slot_nodes[slot] = NULL;
+    filter_slots[slot / 32] &= ~(1u << (slot % 32));
+    overflow_slots[slot / 32] &= ~(1u << (slot % 32));
+    __atomic_fetch_and(&selective_slots[slot / 32], ~(1u << (slot % 32)), __ATOMIC_RELAXED);
+
+    if (node->thread_info->total_subscriptions) {
+        route_rebuild();
+    }
+}
+
+// Frees the slot of a stopped node, must be called holding consumer_sem
+static void route_release(node_t* node) {
+    used_slots[node->slot / 32] &= ~(1u << (node->slot % 32));
+}
+
+// Namespaces accepted in a state
+static uint32_t route_state_namespaces(state_init_s* state_ptr, state_t state) {
+    if (state >= state_ptr->total_states || !state_ptr->translation_table[state].namespaces) {
+        return 0xFFFFFFFF;
+    }
+    return state_ptr->translation_table[state].namespaces;
+}
+
+// Updates the acceptance of a selective machine moving from one state to
+// another, from == NULL_STATE when it enters its first state. Runs on the
+// machine task.
+static void route_accept(node_t* node, state_t from, state_t to) {
+    uint32_t word       = node->slot / 32;
+    uint32_t bit        = 1u << (node->slot % 32);
+    uint32_t namespaces = route_state_namespaces(node->thread_info, to);
+    uint32_t changed    = from == NULL_STATE ? 0xFFFFFFFF : namespaces ^ route_state_namespaces(node->thread_info, from);
+
+    if (!node->selective) {
+        return;
+    }
+
+    while (changed) {
+        int ns = __builtin_ctz(changed);
+        changed &= changed - 1;
+
+        if (namespaces & (1u << ns)) {
+            __atomic_fetch_or(&route_accepts[ns][word], bit, __ATOMIC_RELAXED);
+        } else {
+            __atomic_fetch_and(&route_accepts[ns][word], ~bit, __ATOMIC_RELAXED);
+        }
+    }
+
+    if (from == NULL_STATE) {
+        __atomic_fetch_or(&selective_slots[word], bit, __ATOMIC_RELEASE);
+    }
+}
+
+// Computes the slots an event is delivered to: the subscribers of its
+// segment and the filter_event machines, minus the selective machines whose
+// current state does not accept its namespace
+//
+//   deliver = (subscribed | filter_slots) & ~(selective_slots & ~accepts)
+static void route_match(uint32_t* deliver, const uint32_t* subscribed, const uint32_t* accepts) {
+    int word = 0;
+
+    if (!accepts) {
+        for (; word < ROUTE_MASK_WORDS; word++) {
+            deliver[word] = subscribed[word] | filter_slots[word];
+        }
+        return;
+    }
+
+#if defined(__AVX2__)
+    for (; word + 8 <= ROUTE_MASK_WORDS; word += 8) {
+        __m256i wanted  = _mm256_or_si256(_mm256_loadu_si256((const __m256i*)&subscribed[word]),
+                                          _mm256_loadu_si256((const __m256i*)&filter_slots[word]));
+        __m256i blocked = _mm256_andnot_si256(_mm256_loadu_si256((const __m256i*)&accepts[word]),
+                                              _mm256_loadu_si256((const __m256i*)&selective_slots[word]));
+        _mm256_storeu_si256((__m256i*)&deliver[word], _mm256_andnot_si256(blocked, wanted));
+    }
+#elif defined(__SSE2__)
+    for (; word + 4 <= ROUTE_MASK_WORDS; word += 4) {
+        __m128i wanted  = _mm_or_si128(_mm_loadu_si128((const __m128i*)&subscribed[word]),
+                                       _mm_loadu_si128((const __m128i*)&filter_slots[word]));
+        __m128i blocked = _mm_andnot_si128(_mm_loadu_si128((const __m128i*)&accepts[word]),
+                                           _mm_loadu_si128((const __m128i*)&selective_slots[word]));
+        _mm_storeu_si128((__m128i*)&deliver[word], _mm_andnot_si128(blocked, wanted));
+    }
+#endif
+
+    for (; word < ROUTE_MASK_WORDS; word++) {
+        deliver[word] = (subscribed[word] | filter_slots[word]) & ~(selective_slots[word] & ~accepts[word]);
+    }
+}
+
+// Home position of a key in key_table, Fibonacci hashing
+static uint32_t key_home(uint32_t key) {
+    return (key * 2654435769u) & (STATE_KEY_TABLE_SIZE - 1);
+}
+
+// Position of key in key_table, or of the empty entry ending its probe
+static uint32_t key_find(uint32_t key) {
+    uint32_t at = key_home(key);
+    while (key_table[at].node && key_table[at].key != key) {
+        at = (at + 1) & (STATE_KEY_TABLE_SIZE - 1);
+    }
+    return at;
+}
+
+// Empties an entry, pulling back later entries of the probe so lookups
+// never need tombstones
+static void key_erase(uint32_t at) {
+    uint32_t next = at;
+
+    key_table[at].node->total_keys--;
+    key_table[at].node = NULL;
+    keys_bound--;
+
+    for (;;) {
+        next = (next + 1) & (STATE_KEY_TABLE_SIZE - 1);
+        if (!key_table[next].node) {
+            return;
+        }
+
+        // The entry may move into the hole only if its home is not
+        // cyclically in (at, next]
+        uint32_t home = key_home(key_table[next].key);
+        if (((next - home) & (STATE_KEY_TABLE_SIZE - 1)) >= ((next - at) & (STATE_KEY_TABLE_SIZE - 1))) {
+            key_table[at]        = key_table[next];
+            key_table[next].node = NULL;
+            at                   = next;
+        }
+    }
+}
+
+// Unbinds every key of a node, must be called holding consumer_sem
+static void key_remove_node(node_t* node) {
+    for (uint32_t at = 0; node->total_keys && at < STATE_KEY_TABLE_SIZE;) {
+        if (key_table[at].node == node) {
+            key_erase(at); // Pulls a later entry into at, look at it again
+        } else {
+            at++;
+        }
+    }
+}
+
+// Returns a zeroed registry node, must be called holding consumer_sem
+static node_t* alloc_node() {
+#if (STATE_CORE_STATIC_ALLOCATION == 1)
+    if (free_nodes) {
+        node_t* node = free_nodes;
+        free_nodes   = node->next;
+        memset(node, 0, sizeof(node_t));
+        return node;
+    }
+
+    if (nodes_used == STATE_CORE_MAX_MACHINES) {
+        ESP_LOGE(TAG, "Out of nodes, raise STATE_CORE_MAX_MACHINES!");
+        return NULL;
+    }
+    return &node_pool[nodes_used++];
+#else
+    return calloc(1, sizeof(node_t));
+#endif
+}
+
+// Returns the node of a stopped machine, must be called holding consumer_sem
+static void free_node(node_t* node) {
+#if (STATE_CORE_STATIC_ALLOCATION == 1)
+    node->next = free_nodes;
+    free_nodes = node;
+#else
+    free(node);
+#endif
+}
+
+static void take_bus_sem() {
+    if (pdTRUE != xSemaphoreTake(bus_sem, SATE_MUTEX_WAIT)) {
+        ESP_LOGE(TAG, "FAILED TO TAKE bus_sem!");
+        ASSERT(0);
+    }
+}
+
+// Subscribes a node to the broadcast bus, it reads events published from now
+// on. Must not hold consumer_sem.
+static void bus_add(node_t* node) {
+    take_bus_sem();
+    node->bus_cursor      = bus_head;
+    bus_nodes[node->slot] = node;
+    bus_slots[node->slot / 32] |= 1u << (node->slot % 32);
+    xSemaphoreGive(bus_sem);
+}
+
+// Unsubscribes a node from the broadcast bus before its slot is released,
+// must not hold consumer_sem. A publisher waiting on the node is let go.
+static void bus_remove(node_t* node) {
+    take_bus_sem();
+    bus_slots[node->slot / 32] &= ~(1u << (node->slot % 32));
+    node->bus_cursor      = bus_head;
+    bus_nodes[node->slot] = NULL;
+    xSemaphoreGive(bus_sem);
+    xSemaphoreGive(bus_space);
+}
+
+// Unlinks a node from the registry, returns false if it is not in it. Once
+// unlinked the event_multiplexer and state_post_flags() no longer reach it.
+static bool remove_event_consumer(node_t* node) {
+    if (pdTRUE != xSemaphoreTake(consumer_sem, SATE_MUTEX_WAIT)) {
+        ESP_LOGE(TAG, "FAILED TO TAKE consumer_sem!");
+        ASSERT(0);
+    }
+
+    node_t** link = &head;
+    while (*link != NULL && *link != node) {
+        link = &(*link)->next;
+    }
+
+    bool found = *link != NULL;
+    if (found) {
+        *link = node->next;
+        route_remove(node);
+        key_remove_node(node);
+    }
+
+    xSemaphoreGive(consumer_sem);
+    return found;
+}
+
+// Takes consumer_sem for the reports, which also run on the way out with the
+// scheduler suspended. Returns true if it has to be given back.
+static bool take_consumer_sem_for_report() {
+    if (xTaskGetSchedulerState() != taskSCHEDULER_RUNNING) {
+        return false;
+    }
+    return pdTRUE == xSemaphoreTake(consumer_sem, SATE_MUTEX_WAIT);
+}
+
+// Registers an instance of thread_info, which receives events on queue
+node_t* add_event_consumer(state_init_s* thread_info, QueueHandle_t queue) {
     ESP_LOGI(TAG, "Adding new state machine, name = %s", thread_info->state_name_string);
 
     if (pdTRUE != xSemaphoreTake(consumer_sem, SATE_MUTEX_WAIT)) {
@@ -44,14 +551,16 @@ void add_event_consumer(state_init_s* thread_info) {
     }
 
     if (head == NULL) {
-        head = malloc(sizeof(node_t));
+        head = alloc_node();
         ASSERT(head);
 
         head->next        = NULL;
         head->thread_info = thread_info;
+        head->queue       = queue;
+        route_add(head);
 
         xSemaphoreGive(consumer_sem);
-        return;
+        return head;
     }
 
     node_t* iter = head;
@@ -59,13 +568,49 @@ void add_event_consumer(state_init_s* thread_info) {
     while (iter->next != NULL) {
         iter = iter->next;
     }
-    new = malloc(sizeof(node_t));
+    new = alloc_node();
     ASSERT(new);
 
-    iter->next       = new;
     new->thread_info = thread_info;
+    new->queue       = queue;
     new->next        = NULL;
+    iter->next       = new;
+    route_add(new);
     xSemaphoreGive(consumer_sem);
+    return new;
+}
+
+// Run time of the calling task, as accounted by the kernel
+static uint32_t get_task_run_time() {
+    TaskStatus_t status;
+    vTaskGetInfo(NULL, &status, pdFALSE, eRunning);
+    return status.ulRunTimeCounter;
+}
+
+// Attributes the time spent in the current state to it, and moves the machine
+// to state "to" (routing included). from == NULL_STATE when entering the
+// starting state.
+static void stats_enter_state(node_t* node, state_t from, state_t to) {
+    unsigned long now_wall = ulGetRunTimeCounterValue();
+    uint32_t      now_cpu  = get_task_run_time();
+
+    taskENTER_CRITICAL();
+    if (from < STATE_STATS_MAX_STATES) {
+        node->stats.wall_time_ns[from] += now_wall - node->entered_wall_ns;
+        node->stats.cpu_time_ns[from] += (uint32_t)(now_cpu - node->entered_cpu_ns);
+        if (to < STATE_STATS_MAX_STATES) {
+            node->stats.transitions[from][to]++;
+        }
+    }
+    if (to < STATE_STATS_MAX_STATES) {
+        node->stats.entries[to]++;
+    }
+    node->entered_wall_ns = now_wall;
+    node->entered_cpu_ns  = now_cpu;
+    node->state           = to;
+    taskEXIT_CRITICAL();
+
+    route_accept(node, from, to);
 }
 
 // Returns the state function, given a state
@@ -89,191 +634,1735 @@ static state_event_t get_event_generic(QueueHandle_t q_handle, uint32_t timeout)
     return new_event;
 }
 
-// If the state does not define a send event fucntion, a generic one is provided
-static void send_event_generic(QueueHandle_t q_handle, state_event_t event, char * name) {
-    if (!q_handle){
-      ESP_LOGE(TAG, "NULL HANDLE!");
-      ASSERT(0);
+// Lets the source that woke a state machine produce its event
+static state_event_t get_source_event(state_init_s* state_ptr, QueueSetMemberHandle_t member) {
+    for (int i = 0; i < state_ptr->total_sources; i++) {
+        if (state_ptr->sources[i].handle == member) {
+            return state_ptr->sources[i].on_ready(member);
+        }
     }
 
-    // Should never timeout
-    BaseType_t xStatus = xQueueSendToBack(q_handle, &event, GENERIC_QUEUE_TIMEOUT);
-    if (xStatus != pdTRUE) {
-        ESP_LOGE(TAG, "Failed to send on event queue %s ", name);
-        ASSERT(0);
+    ESP_LOGE(TAG, "%s woken by an unknown source!", state_ptr->state_name_string);
+    ASSERT(0);
+    return INVALID_EVENT;
+}
+
+// Reads the next broadcast bus event a machine wants, in place. Returns false
+// once the machine caught up with the publisher.
+static bool bus_read(node_t* node, state_event_t* event) {
+    state_init_s* state_ptr = node->thread_info;
+
+    while (node->bus_cursor != __atomic_load_n(&bus_head, __ATOMIC_ACQUIRE)) {
+        *event = bus_ring[node->bus_cursor % STATE_BUS_DEPTH];
+        __atomic_store_n(&node->bus_cursor, node->bus_cursor + 1, __ATOMIC_SEQ_CST);
+
+        // The publisher may be waiting for this very slot
+        if (__atomic_load_n(&bus_waiting, __ATOMIC_SEQ_CST) && __atomic_exchange_n(&bus_waiting, 0, __ATOMIC_SEQ_CST)) {
+            xSemaphoreGive(bus_space);
+        }
+
+        if (!state_ptr->filter_event || state_ptr->filter_event(*event)) {
+            return true;
+        }
     }
+    return false;
 }
 
-// Reads from a global event queue and sends the event
-// to all state machines that have registered for the event
-static void event_multiplexer(void* v) {
-    ESP_LOGI(TAG, "Starting event event_multiplexer");
+// Waits for the next event of a state machine. Pending flags are returned
+// first, lowest bit first, then messages, broadcast bus events, and queued
+// events
+static state_event_t get_machine_event(node_t* node, uint32_t timeout) {
+    QueueHandle_t q_handle  = node->queue;
+    state_init_s* state_ptr = node->thread_info;
+
+    if (!node->set) {
+        return get_event_generic(q_handle, timeout);
+    }
+
     for (;;) {
-        state_event_t event;
-        BaseType_t    xStatus;
+        if (node->pending_flags) {
+            uint32_t bit = __builtin_ctz(node->pending_flags);
+            node->pending_flags &= ~STATE_FLAG(bit);
+            return STATE_FLAG_EVENT(bit);
+        }
 
-        xStatus = xQueueReceive(incoming_events_q, (void*)&event, portMAX_DELAY);
-        if (xStatus != pdTRUE) {
-            ESP_LOGE(TAG, "Failed to rx... can't recover..");
-            ASSERT(0);
+        // The doorbell collapses, so look for further messages every time
+        if (node->messages && !xMessageBufferIsEmpty(node->messages)) {
+            size_t len = xMessageBufferReceive(node->messages, node->message_rx, sizeof(node->message_rx), 0);
+            if (len >= sizeof(state_msg_hdr_s)) {
+                node->message_active = true;
+                return ((state_msg_hdr_s*)node->message_rx)->event;
+            }
         }
 
-        ESP_LOGI(TAG, "RXed an event! %d", event);
+        if (state_ptr->bus_subscriber) {
+            state_event_t event;
+            if (bus_read(node, &event)) {
+                return event;
+            }
 
-        // Iterate through all the registered event consumers, see if they
-        // signed up for an event, and if so, send the event to them
-        if (pdTRUE != xSemaphoreTake(consumer_sem, SATE_MUTEX_WAIT)) {
-            ESP_LOGE(TAG, "FAILED TO TAKE consumer_sem!");
-            ASSERT(0);
+            // Ask the publisher for the doorbell, then look once more in case
+            // it published before seeing the request
+            __atomic_store_n(&node->bus_sleeping, 1, __ATOMIC_SEQ_CST);
+            if (bus_read(node, &event)) {
+                __atomic_store_n(&node->bus_sleeping, 0, __ATOMIC_RELAXED);
+                return event;
+            }
         }
 
-        node_t* iter = head;
-        while (iter != NULL) {
-            ESP_LOGI(TAG, "Checking to see if %s is interested in event...", iter->thread_info->state_name_string);
-            if (iter->thread_info->filter_event(event)) {
-                ESP_LOGI(TAG, "sending event %d to %s", event, iter->thread_info->state_name_string);
-                send_event_generic(iter->thread_info->state_queue_input_handle_private, event, iter->thread_info->state_name_string);
-            }
-            iter = iter->next;
+        QueueSetMemberHandle_t member = xQueueSelectFromSet(node->set, timeout);
+        if (member == NULL) {
+            return INVALID_EVENT;
         }
-        xSemaphoreGive(consumer_sem);
-    }
-}
 
-static void state_core_init_freertos_objects() {
-    //Reads and Pushes events from state-machines
-    incoming_events_q = xQueueCreate(EVENT_QUEUE_MAX_DEPTH, sizeof(state_event_t)); // state-machines -> state-core
-    consumer_sem      = xSemaphoreCreateMutex();
+        if (member == q_handle) {
+            return get_event_generic(q_handle, 0);
+        }
 
-    // make sure nothing is NULL!
-    ASSERT(incoming_events_q);
-    ASSERT(consumer_sem);
-}
+        if (member == node->doorbell) {
+            // Flags posted while we were already collecting them leave the
+            // doorbell rung with nothing pending, just wait again
+            xSemaphoreTake(node->doorbell, 0);
+            node->pending_flags |= ulTaskNotifyValueClearIndexed(NULL, STATE_FLAG_NOTIFY_INDEX, 0xFFFFFFFF);
+            continue;
+        }
 
-void state_post_event(state_event_t event) {
-    BaseType_t xStatus = xQueueSendToBack(incoming_events_q, (void*)&event, RTOS_DONT_WAIT);
-    if (xStatus != pdTRUE) {
-        ESP_LOGE(TAG, "Failed to enqueue to event event_multiplexer!");
-        ASSERT(0);
+        state_event_t event = get_source_event(node->thread_info, member);
+        if (event != INVALID_EVENT) {
+            return event;
+        }
     }
 }
 
-static void drain_events(state_init_s * state_ptr){
-    if (!state_ptr) {
-        ESP_LOGE(TAG, "ARG = NULL!");
-        ASSERT(0);
+// Queues an event to a state machine without ever blocking. If the event
+// queue is full, or older events are already waiting, the event waits in the
+// overflow ring of the machine. Must hold consumer_sem.
+static void send_event_generic(node_t* node, state_event_t event) {
+    if (!node->queue){
+      ESP_LOGE(TAG, "NULL HANDLE!");
+      ASSERT(0);
     }
-    state_event_t event;
-    for(;;){
-      BaseType_t xStatus = get_event_generic(state_ptr->state_queue_input_handle_private, 0);
-      if (xStatus == pdPASS) continue;
-    
-      break;
+
+    if (!node->overflow_count && pdTRUE == xQueueSendToBack(node->queue, &event, RTOS_DONT_WAIT)) {
+        return;
+    }
+
+    if (node->overflow_count == STATE_OVERFLOW_DEPTH) {
+        if ((node->stats.dropped_events++ & 0xFF) == 0) {
+            ESP_LOGW(TAG, "%s is not keeping up, %u events dropped", node->thread_info->state_name_string,
+                     node->stats.dropped_events);
+        }
+        return;
+    }
+
+    if (!node->overflow_count) {
+        ESP_LOGW(TAG, "%s is slow, holding back its events", node->thread_info->state_name_string);
+        overflow_slots[node->slot / 32] |= 1u << (node->slot % 32);
     }
+
+    node->overflow[(node->overflow_head + node->overflow_count) % STATE_OVERFLOW_DEPTH] = event;
+    node->overflow_count++;
+    node->stats.overflowed_events++;
 }
 
-static void state_machine(void* arg) {
-    if (!arg) {
-        ESP_LOGE(TAG, "ARG = NULL!");
+// Moves waiting events into the event queues that have room again, in order
+static void flush_overflow() {
+    if (pdTRUE != xSemaphoreTake(consumer_sem, SATE_MUTEX_WAIT)) {
+        ESP_LOGE(TAG, "FAILED TO TAKE consumer_sem!");
         ASSERT(0);
     }
 
-    state_init_s* state_init_ptr = (state_init_s*)(arg);
-    state_t       state          = state_init_ptr->starting_state;
-    state_t       forced_state   = NULL_STATE;
-    state_event_t new_event;
-    
-    for (;;) {
-        // Get the current state information
-        state_array_s state_info = get_state_table(state_init_ptr, state);
-        uint32_t      timeout    = state_info.loop_timer != portTICK_PERIOD_MS ? state_info.loop_timer/portTICK_PERIOD_MS : portTICK_PERIOD_MS;
-        func_ptr      state_func = state_info.state_function_pointer;
+    for (int word = 0; word < ROUTE_MASK_WORDS; word++) {
+        uint32_t bits = overflow_slots[word];
+        while (bits) {
+            int     slot = word * 32 + __builtin_ctz(bits);
+            node_t* node = slot_nodes[slot];
+            bits &= bits - 1;
 
-        // Run the current state;
-        forced_state = state_func();
+            while (node->overflow_count &&
+                   pdTRUE == xQueueSendToBack(node->queue, &node->overflow[node->overflow_head], RTOS_DONT_WAIT)) {
+                node->overflow_head = (node->overflow_head + 1) % STATE_OVERFLOW_DEPTH;
+                node->overflow_count--;
+            }
 
-        if (forced_state != NULL_STATE){
-          // Previous state is forcing next state, don't read from queue
-          ESP_LOGI(TAG, "State %s is forcing next state", state_init_ptr->state_name_string );
-          state = forced_state;
-          continue;
+            if (!node->overflow_count) {
+                overflow_slots[word] &= ~(1u << (slot % 32));
+            }
         }
+    }
 
-        // Wait until a new event comes
-        new_event = get_event_generic(state_init_ptr->state_queue_input_handle_private, timeout);
+    xSemaphoreGive(consumer_sem);
+}
 
-        // Recieved an event, see if we need to change state
-        // Don't run if we had a timeout (looping)
-        if (new_event != INVALID_EVENT){
-          state_init_ptr->next_state(&state, new_event);
+// True while some machine has events waiting in its overflow ring
+static bool overflow_pending() {
+    for (int word = 0; word < ROUTE_MASK_WORDS; word++) {
+        if (overflow_slots[word]) {
+            return true;
         }
-        // Reset new_event
-        new_event = INVALID_EVENT;
     }
+    return false;
 }
 
-void state_core_spawner() {
-    BaseType_t rc;
-
-    state_core_init_freertos_objects();
-    rc = xTaskCreate(event_multiplexer,
-                     "event_multiplexer",
-                     4096,
-                     NULL,
-                     4,
-                     NULL);
+// Has the event_multiplexer look at its timers and overflow rings again. At
+// most one STATE_WAKE_EVENT is queued at a time, so callers may ask as often
+// as they like. If the queue is full the event_multiplexer is about to wake
+// anyway.
+static void wake_multiplexer() {
+    if (__atomic_exchange_n(&multiplexer_wake_pending, 1, __ATOMIC_SEQ_CST)) {
+        return;
+    }
 
-    if (rc != pdPASS) {
+    state_event_t wake = STATE_WAKE_EVENT;
+    if (pdTRUE != xQueueSendToBack(incoming_events_q, &wake, RTOS_DONT_WAIT)) {
+        __atomic_store_n(&multiplexer_wake_pending, 0, __ATOMIC_SEQ_CST);
+    }
+}
+
+// Sends an event to every machine that takes it, must be called holding
+// consumer_sem
+static void route_event(state_event_t event, bool remote) {
+#ifdef POSIX_FREERTOS_SIM
+    state_journal_append(event, STATE_JOURNAL_NO_KEY);
+#endif
+
+    for (int i = 0; i < total_taps && !remote; i++) {
+        for (int range = 0; range < taps[i].total_ranges; range++) {
+            if (event >= taps[i].ranges[range].first && event <= taps[i].ranges[range].last) {
+                taps[i].tap(event, taps[i].arg);
+                break;
+            }
+        }
+    }
+
+    // Work out the exact set of machines to deliver to before sending anything
+    int             segment    = route_find(event);
+    uint32_t        ns         = event / STATE_NAMESPACE_SIZE;
+    const uint32_t* subscribed = (segment >= 0 && segment < route_total_bounds - 1) ? route_masks[segment] : route_none;
+    uint32_t        deliver[ROUTE_MASK_WORDS];
+
+    route_match(deliver, subscribed, ns < STATE_MAX_NAMESPACES ? route_accepts[ns] : NULL);
+
+    for (int word = 0; word < ROUTE_MASK_WORDS; word++) {
+        uint32_t bits = deliver[word];
+        while (bits) {
+            node_t* iter = slot_nodes[word * 32 + __builtin_ctz(bits)];
+            bits &= bits - 1;
+
+            if (iter && (!iter->thread_info->filter_event || iter->thread_info->filter_event(event))) {
+                ESP_LOGI(TAG, "sending event %d to %s", event, iter->thread_info->state_name_string);
+                send_event_generic(iter, event);
+            }
+        }
+    }
+}
+
+static void multiplex_event(state_event_t event) {
+    bool remote = event & STATE_REMOTE_EVENT_FLAG;
+    event &= ~STATE_REMOTE_EVENT_FLAG;
+
+    ESP_LOGI(TAG, "RXed an event! %d", event);
+
+    // Iterate through all the registered event consumers, see if they
+    // signed up for an event, and if so, send the event to them
+    if (pdTRUE != xSemaphoreTake(consumer_sem, SATE_MUTEX_WAIT)) {
+        ESP_LOGE(TAG, "FAILED TO TAKE consumer_sem!");
         ASSERT(0);
     }
+
+    route_event(event, remote);
+    xSemaphoreGive(consumer_sem);
 }
 
-void start_new_state_machine(state_init_s* state_ptr) {
-    if (!state_ptr) {
+static void timer_heap_swap(int a, int b) {
+    uint8_t slot  = timer_heap[a];
+    timer_heap[a] = timer_heap[b];
+    timer_heap[b] = slot;
+
+    timed_events[timer_heap[a]].heap_index = a;
+    timed_events[timer_heap[b]].heap_index = b;
+}
+
+// Restores the heap order around position i, must hold timer_sem
+static void timer_heap_fix(int i) {
+    while (i > 0 && STATE_DEADLINE_BEFORE(timed_events[timer_heap[i]].deadline, timed_events[timer_heap[(i - 1) / 2]].deadline)) {
+        timer_heap_swap(i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+
+    for (;;) {
+        int smallest = i;
+        int left     = 2 * i + 1;
+        int right    = 2 * i + 2;
+
+        if (left < timer_heap_len && STATE_DEADLINE_BEFORE(timed_events[timer_heap[left]].deadline, timed_events[timer_heap[smallest]].deadline)) {
+            smallest = left;
+        }
+        if (right < timer_heap_len && STATE_DEADLINE_BEFORE(timed_events[timer_heap[right]].deadline, timed_events[timer_heap[smallest]].deadline)) {
+            smallest = right;
+        }
+        if (smallest == i) {
+            return;
+        }
+        timer_heap_swap(i, smallest);
+        i = smallest;
+    }
+}
+
+// Removes position i from the heap and frees its slot, must hold timer_sem
+static void timer_heap_remove(int i) {
+    uint8_t slot = timer_heap[i];
+
+    timer_heap_len--;
+    if (i != timer_heap_len) {
+        timer_heap_swap(i, timer_heap_len);
+        timer_heap_fix(i);
+    }
+
+    timed_events[slot].heap_index = -1;
+    timed_events[slot].generation++;
+}
+
+// Ticks until the next delayed event is due
+static TickType_t timers_next_timeout() {
+    TickType_t timeout = portMAX_DELAY;
+
+    xSemaphoreTake(timer_sem, portMAX_DELAY);
+    if (timer_heap_len) {
+        TickType_t now      = xTaskGetTickCount();
+        TickType_t deadline = timed_events[timer_heap[0]].deadline;
+        timeout             = STATE_DEADLINE_BEFORE(now, deadline) ? deadline - now : 0;
+    }
+    xSemaphoreGive(timer_sem);
+
+    return timeout;
+}
+
+// Posts every delayed event that is due, in deadline order
+static void timers_fire_due() {
+    state_event_t due[STATE_MAX_TIMED_EVENTS];
+    int           total_due = 0;
+    TickType_t    now       = xTaskGetTickCount();
+
+    xSemaphoreTake(timer_sem, portMAX_DELAY);
+    while (timer_heap_len && !STATE_DEADLINE_BEFORE(now, timed_events[timer_heap[0]].deadline)) {
+        due[total_due++] = timed_events[timer_heap[0]].event;
+        timer_heap_remove(0);
+    }
+    xSemaphoreGive(timer_sem);
+
+    for (int i = 0; i < total_due; i++) {
+        multiplex_event(due[i]);
+    }
+}
+
+// Posts event once tick is reached, returns a handle for state_cancel_event()
+state_timer_t state_post_event_at(state_event_t event, TickType_t tick) {
+    if (pdTRUE != xSemaphoreTake(timer_sem, SATE_MUTEX_WAIT)) {
+        ESP_LOGE(TAG, "FAILED TO TAKE timer_sem!");
+        ASSERT(0);
+    }
+
+    int slot = 0;
+    while (slot < STATE_MAX_TIMED_EVENTS && timed_events[slot].heap_index != -1) {
+        slot++;
+    }
+    if (slot == STATE_MAX_TIMED_EVENTS) {
+        ESP_LOGE(TAG, "Out of delayed events, raise STATE_MAX_TIMED_EVENTS!");
+        ASSERT(0);
+    }
+
+    timed_events[slot].deadline   = tick;
+    timed_events[slot].event      = event;
+    timed_events[slot].heap_index = timer_heap_len;
+    timer_heap[timer_heap_len++]  = slot;
+    timer_heap_fix(timer_heap_len - 1);
+
+    bool          earliest = timer_heap[0] == slot;
+    state_timer_t timer    = ((state_timer_t)timed_events[slot].generation << 16) | (slot + 1);
+    xSemaphoreGive(timer_sem);
+
+    // The event_multiplexer is sleeping until a later deadline, wake it up
+    if (earliest) {
+        wake_multiplexer();
+    }
+
+    return timer;
+}
+
+// Posts event after delay ticks, returns a handle for state_cancel_event()
+state_timer_t state_post_event_after(state_event_t event, TickType_t delay) {
+    return state_post_event_at(event, xTaskGetTickCount() + delay);
+}
+
+// Cancels a delayed event, returns false if it was already posted (or cancelled)
+bool state_cancel_event(state_timer_t timer) {
+    uint32_t slot       = (timer & 0xFFFF) - 1;
+    uint16_t generation = timer >> 16;
+    bool     cancelled  = false;
+
+    if (slot >= STATE_MAX_TIMED_EVENTS) {
+        return false;
+    }
+
+    if (pdTRUE != xSemaphoreTake(timer_sem, SATE_MUTEX_WAIT)) {
+        ESP_LOGE(TAG, "FAILED TO TAKE timer_sem!");
+        ASSERT(0);
+    }
+
+    if (timed_events[slot].heap_index != -1 && timed_events[slot].generation == generation) {
+        timer_heap_remove(timed_events[slot].heap_index);
+        cancelled = true;
+    }
+
+    xSemaphoreGive(timer_sem);
+    return cancelled;
+}
+
+// Reads from a global event queue and sends the event
+// to all state machines that have registered for the event.
+// Also posts delayed events once they are due.
+static void event_multiplexer(void* v) {
+    ESP_LOGI(TAG, "Starting event event_multiplexer");
+    for (;;) {
+        state_event_t event;
+        BaseType_t    xStatus;
+
+        // Slow machines are retried periodically, besides waking us up as
+        // they make room
+        TickType_t timeout = timers_next_timeout();
+        if (overflow_pending() && timeout > STATE_OVERFLOW_RETRY_TICKS) {
+            timeout = STATE_OVERFLOW_RETRY_TICKS;
+        }
+
+        xStatus = xQueueReceive(incoming_events_q, (void*)&event, timeout);
+        if (xStatus == pdTRUE && event == STATE_WAKE_EVENT) {
+            // Wakes asked for from now on are seen on the next turn
+            __atomic_store_n(&multiplexer_wake_pending, 0, __ATOMIC_SEQ_CST);
+        }
+
+        if (overflow_pending()) {
+            flush_overflow();
+        }
+
+        if (xStatus == pdTRUE && event != STATE_WAKE_EVENT) {
+            multiplex_event(event);
+        }
+
+        timers_fire_due();
+    }
+}
+
+static void state_core_init_freertos_objects() {
+    //Reads and Pushes events from state-machines
+#if (STATE_CORE_STATIC_ALLOCATION == 1)
+    incoming_events_q = xQueueCreateStatic(EVENT_QUEUE_MAX_DEPTH, sizeof(state_event_t), incoming_events_storage, &incoming_events_buffer);
+    consumer_sem      = xSemaphoreCreateMutexStatic(&consumer_sem_buffer);
+    timer_sem         = xSemaphoreCreateMutexStatic(&timer_sem_buffer);
+    bus_sem           = xSemaphoreCreateMutexStatic(&bus_sem_buffer);
+    bus_space         = xSemaphoreCreateBinaryStatic(&bus_space_buffer);
+#else
+    incoming_events_q = xQueueCreate(EVENT_QUEUE_MAX_DEPTH, sizeof(state_event_t)); // state-machines -> state-core
+    consumer_sem      = xSemaphoreCreateMutex();
+    timer_sem         = xSemaphoreCreateMutex();
+    bus_sem           = xSemaphoreCreateMutex();
+    bus_space         = xSemaphoreCreateBinary();
+#endif
+
+    // make sure nothing is NULL!
+    ASSERT(incoming_events_q);
+    ASSERT(consumer_sem);
+    ASSERT(timer_sem);
+    ASSERT(bus_sem);
+    ASSERT(bus_space);
+
+    for (int slot = 0; slot < STATE_MAX_TIMED_EVENTS; slot++) {
+        timed_events[slot].heap_index = -1;
+    }
+}
+
+void state_post_event(state_event_t event) {
+    BaseType_t xStatus = xQueueSendToBack(incoming_events_q, (void*)&event, RTOS_DONT_WAIT);
+    if (xStatus != pdTRUE) {
+        ESP_LOGE(TAG, "Failed to enqueue to event event_multiplexer!");
+        ASSERT(0);
+    }
+}
+
+// Delivers a batch of events from the calling task, see state_post_events()
+static size_t post_batch(const state_event_t* events, size_t total, bool remote) {
+    size_t delivered = 0;
+
+    if (!events) {
         ESP_LOGE(TAG, "ARG==NULL!");
         ASSERT(0);
     }
 
-    // Sanity check(s)
-    if (state_ptr->event_print == NULL || state_ptr->next_state == NULL) {
-        ESP_LOGE(TAG, "ERROR! event_print / next_state func was NULL!");
+    if (pdTRUE != xSemaphoreTake(consumer_sem, SATE_MUTEX_WAIT)) {
+        ESP_LOGE(TAG, "FAILED TO TAKE consumer_sem!");
         ASSERT(0);
     }
 
-    // Sanity check(s)
-    if (state_ptr->translation_table == NULL || state_ptr->state_name_string == NULL) {
-        ESP_LOGE(TAG, "ERROR! translation_table / state_name_string  was NULL!");
+    for (size_t i = 0; i < total; i++) {
+        if (events[i] >= STATE_FLAG_EVENT_START) {
+            ESP_LOGW(TAG, "Skipping event %u of batch, not a plain event", events[i]);
+            continue;
+        }
+        route_event(events[i], remote);
+        delivered++;
+    }
+
+    xSemaphoreGive(consumer_sem);
+    return delivered;
+}
+
+// Delivers a batch of events straight from the calling task, in order,
+// taking the registry lock once for the whole batch instead of passing each
+// event through the event_multiplexer queue. Never waits on a machine, events
+// a slow machine has no room for wait in its overflow ring. Event taps run on
+// the calling task. Returns the number of events delivered, events that are
+// not plain events are skipped.
+size_t state_post_events(const state_event_t* events, size_t total) {
+    return post_batch(events, total, false);
+}
+
+// Batch of events that came from another process or host, delivered like
+// state_post_events() but never handed to the event taps
+size_t state_post_remote_events(const state_event_t* events, size_t total) {
+    return post_batch(events, total, true);
+}
+
+// Posts an event that came from another process or host. It is delivered like
+// a local event, but never handed to the event taps. Does not wait, returns
+// false if the event_multiplexer queue is full.
+bool state_post_remote_event(state_event_t event) {
+    if (event >= STATE_FLAG_EVENT_START) {
+        ESP_LOGE(TAG, "Event %u can't be posted as a remote event!", event);
+        return false;
+    }
+
+    event |= STATE_REMOTE_EVENT_FLAG;
+    return pdTRUE == xQueueSendToBack(incoming_events_q, (void*)&event, RTOS_DONT_WAIT);
+}
+
+// Hands every event posted locally in one of ranges to tap, for example to
+// forward it to another process. ranges must stay valid. Returns false if
+// STATE_MAX_TAPS taps are already added.
+bool state_add_event_tap(const state_range_s* ranges, int total_ranges, state_tap_f tap, void* arg) {
+    if (!ranges || !tap || total_ranges <= 0) {
+        ESP_LOGE(TAG, "ARG==NULL!");
         ASSERT(0);
     }
 
-    // user has set state_queue_input_handle?
-    if(state_ptr->state_queue_input_handle_private){
-       ESP_LOGE(TAG, "User should not set state_queue_input_handle_private!");
-       ASSERT(0);
+    if (pdTRUE != xSemaphoreTake(consumer_sem, SATE_MUTEX_WAIT)) {
+        ESP_LOGE(TAG, "FAILED TO TAKE consumer_sem!");
+        ASSERT(0);
     }
 
-    if(state_ptr->total_states == 0){
-       ESP_LOGE(TAG, "Total states len == 0!");
-       ASSERT(0);
+    bool added = total_taps < STATE_MAX_TAPS;
+    if (added) {
+        taps[total_taps++] = (event_tap_t){ ranges, total_ranges, tap, arg };
+    } else {
+        ESP_LOGW(TAG, "No room for another event tap, raise STATE_MAX_TAPS");
     }
-      
-    state_ptr->state_queue_input_handle_private = xQueueCreate(EVENT_QUEUE_MAX_DEPTH, sizeof(state_event_t)); 
 
-    // make sure we init all the rtos objects
-    ASSERT(state_ptr->state_queue_input_handle_private);
+    xSemaphoreGive(consumer_sem);
+    return added;
+}
 
-    // Register new state machine with event multiplexer
-    add_event_consumer(state_ptr);
+// Sets flags in every state machine whose flag_mask covers them. Flags never
+// take up queue slots, and collapse if posted again before being handled
+void state_post_flags(uint32_t flags) {
+    if (pdTRUE != xSemaphoreTake(consumer_sem, SATE_MUTEX_WAIT)) {
+        ESP_LOGE(TAG, "FAILED TO TAKE consumer_sem!");
+        ASSERT(0);
+    }
 
-    ESP_LOGI(TAG, "Starting new state %s", state_ptr->state_name_string);
-    BaseType_t rc = xTaskCreate(state_machine,
-                                state_ptr->state_name_string,
-                                4096,
-                                (void*)state_ptr,
-                                4,
-                                NULL);
+    for (node_t* iter = head; iter != NULL; iter = iter->next) {
+        uint32_t bits = flags & iter->thread_info->flag_mask;
+        if (bits && iter->task) {
+            xTaskNotifyIndexed(iter->task, STATE_FLAG_NOTIFY_INDEX, bits, eSetBits);
+            xSemaphoreGive(iter->doorbell);
+        }
+    }
+
+    xSemaphoreGive(consumer_sem);
+}
+
+// Fails the state_call() on a call slot, the target is being stopped
+static void refuse_call(call_slot_t* slot) {
+    TaskHandle_t caller = NULL;
+
+    taskENTER_CRITICAL();
+    if (slot->status == CALL_PENDING) {
+        slot->status = CALL_REFUSED;
+        caller       = slot->caller;
+    } else if (slot->status == CALL_ABANDONED) {
+        slot->status = CALL_FREE;
+    }
+    taskEXIT_CRITICAL();
+
+    if (caller) {
+        xTaskNotifyGiveIndexed(caller, STATE_CALL_NOTIFY_INDEX);
+    }
+}
+
+// Empties the event queue and message buffer of a stopped state machine,
+// refusing the calls still queued. Returns the number of events dropped.
+static uint32_t drain_events(node_t* node) {
+    QueueHandle_t q_handle = node->queue;
+    state_event_t event;
+    uint32_t      dropped = 0;
+
+    if (node->active_call) {
+        refuse_call(&call_slots[node->active_call - 1]);
+        node->active_call = 0;
+    }
+
+    while (pdTRUE == xQueueReceive(q_handle, &event, 0)) {
+        if (event == STATE_STOP_EVENT) {
+            continue;
+        }
+        if (event & STATE_CALL_EVENT_FLAG) {
+            refuse_call(&call_slots[(event >> STATE_CALL_SLOT_SHIFT) & (STATE_MAX_CALLS - 1)]);
+        }
+        dropped++;
+    }
+
+    while (node->messages && xMessageBufferReceive(node->messages, node->message_rx, sizeof(node->message_rx), 0)) {
+        dropped++;
+    }
+
+    // The node is unlinked, the event_multiplexer no longer looks at the ring
+    dropped += node->overflow_count;
+    node->overflow_count = 0;
+
+    dropped += node->defer_count;
+    node->defer_count  = 0;
+    node->defer_replay = 0;
+
+    return dropped;
+}
+
+// Holds back an event the current state defers, returns false if there is no
+// room left, in which case the event must be handled right away
+static bool defer_event(node_t* node, state_event_t event) {
+    if (node->defer_count == STATE_DEFER_DEPTH) {
+        if ((node->stats.defer_overflows++ & 0xFF) == 0) {
+            ESP_LOGW(TAG, "%s deferred more than %d events", node->thread_info->state_name_string, STATE_DEFER_DEPTH);
+        }
+        return false;
+    }
+
+    node->deferred[(node->defer_head + node->defer_count) % STATE_DEFER_DEPTH] = event;
+    node->defer_count++;
+    node->stats.deferred_events++;
+    return true;
+}
+
+// Takes the oldest deferred event, to be delivered again
+static state_event_t replay_deferred_event(node_t* node) {
+    state_event_t event = node->deferred[node->defer_head];
+
+    node->defer_head = (node->defer_head + 1) % STATE_DEFER_DEPTH;
+    node->defer_count--;
+    node->defer_replay--;
+    return event;
+}
+
+// Parks a state machine that received STATE_STOP_EVENT, stop_state_machine()
+// deletes it from here. Parking between events means the task holds no locks.
+static void park_state_machine(node_t* node) {
+    taskENTER_CRITICAL();
+    node->parked = true;
+    taskEXIT_CRITICAL();
+
+    xTaskNotifyGiveIndexed(node->stopper, STATE_CALL_NOTIFY_INDEX);
+    for (;;) {
+        vTaskSuspend(NULL);
+    }
+}
+
+static void state_machine(void* arg) {
+    if (!arg) {
+        ESP_LOGE(TAG, "ARG = NULL!");
+        ASSERT(0);
+    }
+
+    node_t*       node           = (node_t*)(arg);
+    state_init_s* state_init_ptr = node->thread_info;
+    state_t       state          = node->state;
+    state_t       forced_state   = NULL_STATE;
+    state_event_t new_event;
+
+    // Lets state_reply() find the machine it is called from
+    vTaskSetThreadLocalStoragePointer(NULL, STATE_TLS_INDEX, node);
+
+    stats_enter_state(node, NULL_STATE, state);
+
+    for (;;) {
+        // Get the current state information
+        state_array_s state_info = get_state_table(state_init_ptr, state);
+        uint32_t      timeout    = state_info.loop_timer != portTICK_PERIOD_MS ? state_info.loop_timer/portTICK_PERIOD_MS : portTICK_PERIOD_MS;
+        func_ptr      state_func = state_info.state_function_pointer;
+
+        // Run the current state;
+        forced_state = state_func();
+
+        if (forced_state != NULL_STATE){
+          // Previous state is forcing next state, don't read from queue
+          ESP_LOGI(TAG, "State %s is forcing next state", state_init_ptr->state_name_string );
+          stats_enter_state(node, state, forced_state);
+          state              = forced_state;
+          node->defer_replay = node->defer_count;
+          continue;
+        }
+
+        // Events deferred by earlier states go first, then wait until a new
+        // event comes
+        if (node->defer_replay) {
+            new_event = replay_deferred_event(node);
+        } else {
+            new_event = get_machine_event(node, timeout);
+        }
+
+        if (new_event == STATE_STOP_EVENT) {
+            park_state_machine(node);
+        }
+
+        // There is room in the queue now, have the event_multiplexer move our
+        // held back events in
+        if (node->overflow_count && new_event != INVALID_EVENT) {
+            wake_multiplexer();
+        }
+
+        // Recieved an event, see if we need to change state
+        // Don't run if we had a timeout (looping)
+        if (new_event != INVALID_EVENT){
+          if (new_event & STATE_CALL_EVENT_FLAG) {
+            node->active_call = ((new_event >> STATE_CALL_SLOT_SHIFT) & (STATE_MAX_CALLS - 1)) + 1;
+            new_event &= STATE_CALL_EVENT_MASK;
+          }
+
+          // The state postpones the event. Calls and messages are never
+          // deferred, their caller / payload can not wait.
+          uint32_t defer_bit = new_event - state_init_ptr->defer_event_base;
+          if (defer_bit < 32 && (state_info.defer & (1u << defer_bit)) && !node->active_call &&
+              !node->message_active && defer_event(node, new_event)) {
+            continue;
+          }
+
+          state_init_ptr->next_state(&state, new_event);
+          if (state != node->state) {
+            stats_enter_state(node, node->state, state);
+            node->defer_replay = node->defer_count;
+          }
+
+          // The handler did not reply to the call, answer with our state
+          if (node->active_call) {
+            state_reply(state);
+          }
+
+          // The payload of a message is only lent for the duration of next_state
+          node->message_active = false;
+        }
+        // Reset new_event
+        new_event = INVALID_EVENT;
+    }
+}
+
+void state_core_spawner() {
+    BaseType_t rc;
+
+    state_core_init_freertos_objects();
+
+#if (STATE_CORE_STATIC_ALLOCATION == 1)
+    multiplexer_task = xTaskCreateStatic(event_multiplexer,
+                                         "event_multiplexer",
+                                         STATE_MULTIPLEXER_STACK_DEPTH,
+                                         NULL,
+                                         STATE_MULTIPLEXER_PRIORITY,
+                                         multiplexer_stack,
+                                         &multiplexer_task_buffer);
+    rc = multiplexer_task ? pdPASS : pdFAIL;
+#else
+    rc = xTaskCreate(event_multiplexer,
+                     "event_multiplexer",
+                     STATE_MULTIPLEXER_STACK_DEPTH,
+                     NULL,
+                     STATE_MULTIPLEXER_PRIORITY,
+                     &multiplexer_task);
+#endif
 
     if (rc != pdPASS) {
         ASSERT(0);
     }
 }
+
+// Creates the queue set a state machine waits on, holding its event queue,
+// its doorbell and its sources. Must run before the machine is registered,
+// members can only be added to a set while empty.
+static void create_input_set(state_init_s* state_ptr, state_storage_s* storage, QueueHandle_t queue,
+                             QueueSetHandle_t* set, SemaphoreHandle_t* doorbell) {
+    UBaseType_t length = EVENT_QUEUE_MAX_DEPTH + 1;
+
+    if (state_ptr->total_sources && !state_ptr->sources) {
+        ESP_LOGE(TAG, "%s has total_sources but no sources!", state_ptr->state_name_string);
+        ASSERT(0);
+    }
+
+    for (int i = 0; i < state_ptr->total_sources; i++) {
+        if (!state_ptr->sources[i].handle || !state_ptr->sources[i].on_ready || !state_ptr->sources[i].length) {
+            ESP_LOGE(TAG, "Source %d of %s is incomplete!", i, state_ptr->state_name_string);
+            ASSERT(0);
+        }
+        length += state_ptr->sources[i].length;
+    }
+
+#if (STATE_CORE_STATIC_ALLOCATION == 1)
+    if(!storage->set_storage || !storage->set_buffer || !storage->doorbell_buffer){
+       ESP_LOGE(TAG, "%s has no static set storage, see STATE_MACHINE_STATIC_STORAGE", state_ptr->state_name_string);
+       ASSERT(0);
+    }
+    ASSERT(length <= STATE_SET_MAX_LENGTH);
+
+    *set      = xQueueGenericCreateStatic(length, sizeof(QueueSetMemberHandle_t), storage->set_storage,
+                                          storage->set_buffer, queueQUEUE_TYPE_SET);
+    *doorbell = xSemaphoreCreateBinaryStatic(storage->doorbell_buffer);
+#else
+    *set      = xQueueCreateSet(length);
+    *doorbell = xSemaphoreCreateBinary();
+#endif
+
+    // make sure we init all the rtos objects
+    ASSERT(*set);
+    ASSERT(*doorbell);
+
+    if (pdPASS != xQueueAddToSet(queue, *set) ||
+        pdPASS != xQueueAddToSet(*doorbell, *set)) {
+        ESP_LOGE(TAG, "Failed to build input set of %s", state_ptr->state_name_string);
+        ASSERT(0);
+    }
+
+    for (int i = 0; i < state_ptr->total_sources; i++) {
+        if (pdPASS != xQueueAddToSet(state_ptr->sources[i].handle, *set)) {
+            ESP_LOGE(TAG, "Source %d of %s is not empty or already in a set!", i, state_ptr->state_name_string);
+            ASSERT(0);
+        }
+    }
+}
+
+// Starts an instance of a state machine in first_state. storage is only used
+// in static mode.
+static state_handle_t start_state_machine(state_init_s* state_ptr, state_t first_state, void* context, state_storage_s* storage) {
+    if (!state_ptr) {
+        ESP_LOGE(TAG, "ARG==NULL!");
+        ASSERT(0);
+    }
+
+    // Sanity check(s)
+    if (state_ptr->event_print == NULL || state_ptr->next_state == NULL) {
+        ESP_LOGE(TAG, "ERROR! event_print / next_state func was NULL!");
+        ASSERT(0);
+    }
+
+    // Sanity check(s)
+    if (state_ptr->translation_table == NULL || state_ptr->state_name_string == NULL) {
+        ESP_LOGE(TAG, "ERROR! translation_table / state_name_string  was NULL!");
+        ASSERT(0);
+    }
+
+    if(state_ptr->total_states == 0){
+       ESP_LOGE(TAG, "Total states len == 0!");
+       ASSERT(0);
+    }
+
+    if(!state_ptr->filter_event && !state_ptr->total_subscriptions){
+       ESP_LOGE(TAG, "%s needs a filter_event or subscriptions!", state_ptr->state_name_string);
+       ASSERT(0);
+    }
+
+    for (int i = 0; i < state_ptr->total_subscriptions; i++) {
+        if (state_ptr->subscriptions[i].first > state_ptr->subscriptions[i].last ||
+            state_ptr->subscriptions[i].last >= STATE_FLAG_EVENT_START) {
+            ESP_LOGE(TAG, "Subscription %d of %s is invalid!", i, state_ptr->state_name_string);
+            ASSERT(0);
+        }
+    }
+      
+    QueueHandle_t queue;
+#if (STATE_CORE_STATIC_ALLOCATION == 1)
+    if(!storage || !storage->queue_storage || !storage->queue_buffer || !storage->task_buffer || !storage->stack || !state_ptr->stack_depth){
+       ESP_LOGE(TAG, "%s has no static storage, see STATE_MACHINE_STATIC_STORAGE", state_ptr->state_name_string);
+       ASSERT(0);
+    }
+
+    queue = xQueueCreateStatic(EVENT_QUEUE_MAX_DEPTH, sizeof(state_event_t), storage->queue_storage, storage->queue_buffer);
+#else
+    queue = xQueueCreate(EVENT_QUEUE_MAX_DEPTH, sizeof(state_event_t)); 
+#endif
+
+    // make sure we init all the rtos objects
+    ASSERT(queue);
+
+    if(state_ptr->total_states > STATE_STATS_MAX_STATES){
+       ESP_LOGW(TAG, "Only the first %d states of %s are accounted in stats", STATE_STATS_MAX_STATES, state_ptr->state_name_string);
+    }
+
+    // Machines with inputs other than their event queue wait on a queue set
+    QueueSetHandle_t  set      = NULL;
+    SemaphoreHandle_t doorbell = NULL;
+    if (state_ptr->flag_mask || state_ptr->total_sources || state_ptr->message_buffer_size || state_ptr->bus_subscriber) {
+        create_input_set(state_ptr, storage, queue, &set, &doorbell);
+    }
+
+    MessageBufferHandle_t messages    = NULL;
+    SemaphoreHandle_t     message_sem = NULL;
+    if (state_ptr->message_buffer_size) {
+#if (STATE_CORE_STATIC_ALLOCATION == 1)
+        if(!storage->message_storage || !storage->message_buffer || !storage->message_sem_buffer){
+           ESP_LOGE(TAG, "%s has no static message storage, see STATE_MACHINE_STATIC_MESSAGES", state_ptr->state_name_string);
+           ASSERT(0);
+        }
+        messages    = xMessageBufferCreateStatic(state_ptr->message_buffer_size, storage->message_storage, storage->message_buffer);
+        message_sem = xSemaphoreCreateMutexStatic(storage->message_sem_buffer);
+#else
+        messages    = xMessageBufferCreate(state_ptr->message_buffer_size);
+        message_sem = xSemaphoreCreateMutex();
+#endif
+        // make sure we init all the rtos objects
+        ASSERT(messages);
+        ASSERT(message_sem);
+    }
+
+    uint32_t    stack_depth = state_ptr->stack_depth ? state_ptr->stack_depth : STATE_MACHINE_STACK_DEPTH;
+    UBaseType_t priority    = state_ptr->priority ? state_ptr->priority : STATE_MACHINE_PRIORITY;
+
+    // Register new state machine with event multiplexer
+    node_t* node      = add_event_consumer(state_ptr, queue);
+    node->context     = context;
+    node->stack_depth = stack_depth;
+    node->set         = set;
+    node->doorbell    = doorbell;
+    node->messages    = messages;
+    node->message_sem = message_sem;
+    node->state       = first_state;
+
+    if (state_ptr->bus_subscriber) {
+        bus_add(node);
+    }
+
+    ESP_LOGI(TAG, "Starting new state %s", state_ptr->state_name_string);
+#if (STATE_CORE_STATIC_ALLOCATION == 1)
+    node->task = xTaskCreateStatic(state_machine,
+                                   state_ptr->state_name_string,
+                                   stack_depth,
+                                   (void*)node,
+                                   priority,
+                                   storage->stack,
+                                   storage->task_buffer);
+    BaseType_t rc = node->task ? pdPASS : pdFAIL;
+#else
+    BaseType_t rc = xTaskCreate(state_machine,
+                                state_ptr->state_name_string,
+                                stack_depth,
+                                (void*)node,
+                                priority,
+                                &node->task);
+#endif
+
+    if (rc != pdPASS) {
+        ASSERT(0);
+    }
+
+    return node;
+}
+
+// Storage of the instance a definition carries itself
+static state_storage_s* default_storage(state_init_s* state_ptr) {
+#if (STATE_CORE_STATIC_ALLOCATION == 1)
+    return &state_ptr->storage;
+#else
+    return NULL;
+#endif
+}
+
+state_handle_t start_new_state_machine(state_init_s* state_ptr) {
+    if (!state_ptr) {
+        ESP_LOGE(TAG, "ARG==NULL!");
+        ASSERT(0);
+    }
+    return start_state_machine(state_ptr, state_ptr->starting_state, state_ptr->context, default_storage(state_ptr));
+}
+
+// Starts one more instance of a state machine definition. Each instance has
+// its own state, event queue and task, and a context of
+// state_ptr->context_size bytes its state functions reach through
+// state_context(). storage is only used in static mode, where it must not be
+// shared with another running instance.
+state_handle_t start_state_machine_instance(state_init_s* state_ptr, void* context, state_storage_s* storage) {
+    if (!state_ptr) {
+        ESP_LOGE(TAG, "ARG==NULL!");
+        ASSERT(0);
+    }
+    return start_state_machine(state_ptr, state_ptr->starting_state, context, storage);
+}
+
+// Context of the state machine instance calling, NULL outside of one
+void* state_context(void) {
+    node_t* node = pvTaskGetThreadLocalStoragePointer(NULL, STATE_TLS_INDEX);
+    return node ? node->context : NULL;
+}
+
+// Deletes the RTOS objects of a stopped state machine, whose task is already
+// gone, and hands back its node. Its storage can then be used again.
+static void release_state_machine(node_t* node) {
+    state_init_s* state_ptr = node->thread_info;
+    uint32_t      dropped   = drain_events(node);
+
+    if (dropped) {
+        ESP_LOGW(TAG, "Dropped %u pending events of %s", dropped, state_ptr->state_name_string);
+    }
+
+    // Sources outlive the machine, they must not point at a deleted set
+    for (int i = 0; node->set && i < state_ptr->total_sources; i++) {
+        if (pdPASS != xQueueRemoveFromSet(state_ptr->sources[i].handle, node->set)) {
+            ESP_LOGE(TAG, "Source %d of %s must be empty when stopping it!", i, state_ptr->state_name_string);
+            ASSERT(0);
+        }
+    }
+
+    if (node->set) {
+        xQueueRemoveFromSet(node->queue, node->set);
+        xQueueRemoveFromSet(node->doorbell, node->set);
+        vSemaphoreDelete(node->doorbell);
+        vQueueDelete(node->set);
+    }
+
+    if (node->messages) {
+        vMessageBufferDelete(node->messages);
+        vSemaphoreDelete(node->message_sem);
+    }
+
+    vQueueDelete(node->queue);
+
+    if (pdTRUE != xSemaphoreTake(consumer_sem, SATE_MUTEX_WAIT)) {
+        ESP_LOGE(TAG, "FAILED TO TAKE consumer_sem!");
+        ASSERT(0);
+    }
+    route_release(node);
+    free_node(node);
+    xSemaphoreGive(consumer_sem);
+}
+
+// Stops a state machine: unsubscribes it, waits for it to finish the event it
+// is handling, deletes its task and RTOS objects and reclaims its node.
+// Pending events are dropped and queued state_call()s fail. The handle is
+// invalid afterwards. Sources must be empty at this point.
+//
+// A machine may stop itself, in which case this does not return. Its static
+// task buffers are then only reusable once the idle task has run.
+// Returns false if the machine is not running.
+bool stop_state_machine(state_handle_t handle) {
+    node_t* node = handle;
+
+    if (!node) {
+        ESP_LOGE(TAG, "ARG==NULL!");
+        ASSERT(0);
+    }
+
+    if (!remove_event_consumer(node)) {
+        ESP_LOGW(TAG, "Stopping a state machine that is not running!");
+        return false;
+    }
+
+    // Off the bus before its slot can be handed out again
+    if (node->thread_info->bus_subscriber) {
+        bus_remove(node);
+    }
+
+    ESP_LOGI(TAG, "Stopping state machine %s", node->thread_info->state_name_string);
+
+    if (node->task == xTaskGetCurrentTaskHandle()) {
+        // Nothing touches the node once it is released
+        release_state_machine(node);
+        vTaskDelete(NULL);
+    }
+
+    // Jumps ahead of the pending events, which are dropped anyway
+    node->stopper = xTaskGetCurrentTaskHandle();
+    state_event_t stop = STATE_STOP_EVENT;
+    xQueueSendToFront(node->queue, &stop, portMAX_DELAY);
+
+    // Notifications left over from timed out state_call()s may wake us early
+    while (!node->parked) {
+        ulTaskNotifyTakeIndexed(STATE_CALL_NOTIFY_INDEX, pdTRUE, portMAX_DELAY);
+    }
+
+    vTaskDelete(node->task);
+    release_state_machine(node);
+    return true;
+}
+
+// Hands the reply to the caller waiting on a call slot, or frees the slot if
+// the caller gave up waiting
+static void complete_call(call_slot_t* slot, uint32_t value) {
+    TaskHandle_t caller = NULL;
+
+    taskENTER_CRITICAL();
+    if (slot->status == CALL_PENDING) {
+        if (slot->reply) {
+            *slot->reply = value;
+        }
+        slot->status = CALL_REPLIED;
+        caller       = slot->caller;
+    } else if (slot->status == CALL_ABANDONED) {
+        slot->status = CALL_FREE;
+    }
+    taskEXIT_CRITICAL();
+
+    if (caller) {
+        xTaskNotifyGiveIndexed(caller, STATE_CALL_NOTIFY_INDEX);
+    }
+}
+
+// Sends event straight to the event queue of a state machine (bypassing
+// filter_event) and blocks until its next_state replies with state_reply().
+// If the handler does not reply, the reply is the state the machine is in
+// after handling the event. timeout applies to enqueueing and to waiting for
+// the reply. Returns false if there was no reply in time.
+bool state_call(state_handle_t handle, state_event_t event, uint32_t* reply, TickType_t timeout) {
+    node_t* node = handle;
+
+    if (!node) {
+        ESP_LOGE(TAG, "ARG==NULL!");
+        ASSERT(0);
+    }
+
+    if (event & ~STATE_CALL_EVENT_MASK) {
+        ESP_LOGE(TAG, "Event %u can't be used with state_call!", event);
+        ASSERT(0);
+    }
+
+    if (node->task == xTaskGetCurrentTaskHandle()) {
+        ESP_LOGE(TAG, "%s can't call itself!", node->thread_info->state_name_string);
+        ASSERT(0);
+    }
+
+    int slot = -1;
+    taskENTER_CRITICAL();
+    for (int i = 0; i < STATE_MAX_CALLS; i++) {
+        if (call_slots[i].status == CALL_FREE) {
+            call_slots[i].status = CALL_PENDING;
+            call_slots[i].caller = xTaskGetCurrentTaskHandle();
+            call_slots[i].reply  = reply;
+            slot                 = i;
+            break;
+        }
+    }
+    taskEXIT_CRITICAL();
+
+    if (slot == -1) {
+        ESP_LOGE(TAG, "Out of call slots, raise STATE_MAX_CALLS!");
+        return false;
+    }
+
+    // A reply that raced an earlier timeout may have left a notification
+    xTaskNotifyStateClearIndexed(NULL, STATE_CALL_NOTIFY_INDEX);
+    ulTaskNotifyValueClearIndexed(NULL, STATE_CALL_NOTIFY_INDEX, 0xFFFFFFFF);
+
+    state_event_t request = STATE_CALL_EVENT_FLAG | ((state_event_t)slot << STATE_CALL_SLOT_SHIFT) | event;
+    if (pdTRUE != xQueueSendToBack(node->queue, &request, timeout)) {
+        taskENTER_CRITICAL();
+        call_slots[slot].status = CALL_FREE;
+        taskEXIT_CRITICAL();
+        return false;
+    }
+
+    ulTaskNotifyTakeIndexed(STATE_CALL_NOTIFY_INDEX, pdTRUE, timeout);
+
+    taskENTER_CRITICAL();
+    bool replied            = call_slots[slot].status == CALL_REPLIED;
+    bool refused            = call_slots[slot].status == CALL_REFUSED;
+    call_slots[slot].status = (replied || refused) ? CALL_FREE : CALL_ABANDONED;
+    taskEXIT_CRITICAL();
+
+    return replied;
+}
+
+// Replies to the state_call() the calling state machine is handling. Only
+// valid from within next_state, returns false if there is nothing to reply to.
+bool state_reply(uint32_t value) {
+    node_t* node = pvTaskGetThreadLocalStoragePointer(NULL, STATE_TLS_INDEX);
+
+    if (!node || !node->active_call) {
+        ESP_LOGW(TAG, "state_reply called outside of a state_call!");
+        return false;
+    }
+
+    call_slot_t* slot = &call_slots[node->active_call - 1];
+    node->active_call = 0;
+    complete_call(slot, value);
+    return true;
+}
+
+// Posts a message of up to STATE_MSG_MAX_PAYLOAD bytes to a state machine with
+// a message buffer. next_state sees event, and can borrow the payload with
+// state_message_payload(). Returns false if there was no room before timeout.
+bool state_post_message(state_handle_t handle, state_event_t event, const void* payload, size_t len, TickType_t timeout) {
+    node_t* node = handle;
+
+    if (!node || (len && !payload)) {
+        ESP_LOGE(TAG, "ARG==NULL!");
+        ASSERT(0);
+    }
+
+    if (!node->messages) {
+        ESP_LOGE(TAG, "%s has no message_buffer_size!", node->thread_info->state_name_string);
+        ASSERT(0);
+    }
+
+    if (len > STATE_MSG_MAX_PAYLOAD || event >= STATE_FLAG_EVENT_START) {
+        ESP_LOGE(TAG, "Message %u of %u bytes is invalid!", event, (unsigned)len);
+        ASSERT(0);
+    }
+
+    uint8_t          message[sizeof(state_msg_hdr_s) + STATE_MSG_MAX_PAYLOAD];
+    state_msg_hdr_s* hdr = (state_msg_hdr_s*)message;
+    hdr->event           = event;
+    hdr->len             = len;
+    if (len) {
+        memcpy(message + sizeof(state_msg_hdr_s), payload, len);
+    }
+
+    // Message buffers only support a single writer at a time
+    if (pdTRUE != xSemaphoreTake(node->message_sem, timeout)) {
+        return false;
+    }
+    size_t sent = xMessageBufferSend(node->messages, message, sizeof(state_msg_hdr_s) + len, timeout);
+    xSemaphoreGive(node->message_sem);
+
+    if (sent) {
+        xSemaphoreGive(node->doorbell);
+    }
+    return sent != 0;
+}
+
+// Lends the payload of the message being handled to next_state, the view is
+// only valid until next_state returns. Returns NULL if the event being handled
+// is not a message.
+const void* state_message_payload(size_t* len) {
+    node_t* node = pvTaskGetThreadLocalStoragePointer(NULL, STATE_TLS_INDEX);
+
+    if (!node || !node->message_active) {
+        return NULL;
+    }
+
+    if (len) {
+        *len = ((state_msg_hdr_s*)node->message_rx)->len;
+    }
+    return node->message_rx + sizeof(state_msg_hdr_s);
+}
+
+// Copies the time-in-state accounting of a running instance, returns false
+// if it is not running (anymore)
+bool state_core_get_stats(state_handle_t handle, state_stats_s* stats) {
+    if (!handle || !stats) {
+        ESP_LOGE(TAG, "ARG==NULL!");
+        ASSERT(0);
+    }
+
+    if (pdTRUE != xSemaphoreTake(consumer_sem, SATE_MUTEX_WAIT)) {
+        ESP_LOGE(TAG, "FAILED TO TAKE consumer_sem!");
+        ASSERT(0);
+    }
+
+    // The handle is only looked up, a stopped instance may be gone
+    node_t* iter = head;
+    while (iter != NULL && iter != handle) {
+        iter = iter->next;
+    }
+
+    if (iter) {
+        taskENTER_CRITICAL();
+        memcpy(stats, &iter->stats, sizeof(state_stats_s));
+        taskEXIT_CRITICAL();
+    }
+
+    xSemaphoreGive(consumer_sem);
+    return iter != NULL;
+}
+
+// Prints the time-in-state accounting of every state machine. The simulator
+// also calls it on Ctrl+C with the scheduler suspended, it then walks the
+// registry without consumer_sem.
+void state_core_dump_stats(void) {
+    bool locked = take_consumer_sem_for_report();
+
+    for (node_t* iter = head; iter != NULL; iter = iter->next) {
+        state_init_s*  state_ptr = iter->thread_info;
+        state_stats_s* stats     = &iter->stats;
+        int            states    = state_ptr->total_states < STATE_STATS_MAX_STATES ? state_ptr->total_states : STATE_STATS_MAX_STATES;
+
+        ESP_LOGI(TAG, "Stats for %s, currently in state %u, %u events held back, %u dropped, %u deferred",
+                 state_ptr->state_name_string, iter->state, stats->overflowed_events, stats->dropped_events,
+                 stats->deferred_events);
+        for (int from = 0; from < states; from++) {
+            ESP_LOGI(TAG, "  state %d: entered %u times, wall %llu ns, cpu %llu ns", from, stats->entries[from],
+                     (unsigned long long)stats->wall_time_ns[from], (unsigned long long)stats->cpu_time_ns[from]);
+            for (int to = 0; to < states; to++) {
+                if (stats->transitions[from][to]) {
+                    ESP_LOGI(TAG, "    %d -> %d: %u", from, to, stats->transitions[from][to]);
+                }
+            }
+        }
+    }
+
+    if (locked) {
+        xSemaphoreGive(consumer_sem);
+    }
+}
+
+// Recommended stack size, in words, for a task that peaked at "used" words
+static uint32_t recommended_stack_depth(uint32_t used) {
+    uint32_t recommended = used + (used * STATE_STACK_MARGIN_PERCENT) / 100;
+
+    if (recommended < configMINIMAL_STACK_SIZE) {
+        recommended = configMINIMAL_STACK_SIZE;
+    }
+    return (recommended + 15) & ~15u;
+}
+
+static void stack_report_task(const char* name, TaskHandle_t task, uint32_t depth) {
+    if (!task) {
+        return;
+    }
+
+    uint32_t unused = uxTaskGetStackHighWaterMark(task);
+    uint32_t used   = depth - unused;
+    ESP_LOGI(TAG, "  %-20s stack %u words, peak %u words, recommended .stack_depth = %u",
+             name, depth, used, recommended_stack_depth(used));
+}
+
+// Prints the peak stack usage of the multiplexer and every state machine so
+// far, along with a recommended stack_depth including STATE_STACK_MARGIN_PERCENT
+// of headroom. Run the application through its paths, then feed the numbers
+// back into state_init_s. Also called on Ctrl+C, like state_core_dump_stats().
+void state_core_stack_report(void) {
+    bool locked = take_consumer_sem_for_report();
+
+    ESP_LOGI(TAG, "Stack usage:");
+    stack_report_task("event_multiplexer", multiplexer_task, STATE_MULTIPLEXER_STACK_DEPTH);
+    for (node_t* iter = head; iter != NULL; iter = iter->next) {
+        stack_report_task(iter->thread_info->state_name_string, iter->task, iter->stack_depth);
+    }
+
+    if (locked) {
+        xSemaphoreGive(consumer_sem);
+    }
+}
+
+/**********************************************************
+*                                           BROADCAST BUS *
+**********************************************************/
+
+// Slowest cursor of the bus subscribers, bus_head if there are none. Must
+// hold bus_sem.
+static uint32_t bus_slowest_cursor() {
+    uint32_t slowest = bus_head;
+
+    for (int word = 0; word < ROUTE_MASK_WORDS; word++) {
+        uint32_t bits = bus_slots[word];
+        while (bits) {
+            node_t*  node   = bus_nodes[word * 32 + __builtin_ctz(bits)];
+            uint32_t cursor = __atomic_load_n(&node->bus_cursor, __ATOMIC_SEQ_CST);
+            bits &= bits - 1;
+
+            if ((int32_t)(cursor - slowest) < 0) {
+                slowest = cursor;
+            }
+        }
+    }
+    return slowest;
+}
+
+// Rings the doorbell of the subscribers waiting for bus events. Subscribers
+// still busy reading are not touched. Must hold bus_sem.
+static void bus_wake_sleepers() {
+    for (int word = 0; word < ROUTE_MASK_WORDS; word++) {
+        uint32_t bits = bus_slots[word];
+        while (bits) {
+            node_t* node = bus_nodes[word * 32 + __builtin_ctz(bits)];
+            bits &= bits - 1;
+
+            if (__atomic_load_n(&node->bus_sleeping, __ATOMIC_SEQ_CST) && __atomic_exchange_n(&node->bus_sleeping, 0, __ATOMIC_SEQ_CST)) {
+                xSemaphoreGive(node->doorbell);
+            }
+        }
+    }
+}
+
+// Publishes events to every bus subscriber at the cost of one copy into the
+// ring, rather than one queue send per subscriber. Waits up to timeout for
+// the slowest subscriber to make room, returns false if it did not, in which
+// case only some of the events may have been published. While waiting for
+// room the publisher lets go of the bus, so the events of publishers that
+// wait may interleave. A bus subscriber publishing more than STATE_BUS_DEPTH
+// events waits on itself, so it should not use portMAX_DELAY.
+bool state_bus_publish(const state_event_t* events, size_t total, TickType_t timeout) {
+    TimeOut_t start;
+
+    if (!events) {
+        ESP_LOGE(TAG, "ARG==NULL!");
+        ASSERT(0);
+    }
+
+    vTaskSetTimeOutState(&start);
+    if (pdTRUE != xSemaphoreTake(bus_sem, timeout)) {
+        return false;
+    }
+
+    for (size_t i = 0; i < total; i++) {
+        // Only walk the cursors when the cached gate says the ring is full
+        while (bus_head - bus_gate >= STATE_BUS_DEPTH) {
+            __atomic_store_n(&bus_waiting, 1, __ATOMIC_SEQ_CST);
+            bus_gate = bus_slowest_cursor();
+            if (bus_head - bus_gate < STATE_BUS_DEPTH) {
+                __atomic_store_n(&bus_waiting, 0, __ATOMIC_RELAXED);
+                break;
+            }
+
+            // Let the subscribers see what is already there, and let go of
+            // the bus so subscribers can come and go while we wait
+            bus_wake_sleepers();
+            xSemaphoreGive(bus_sem);
+            if (pdTRUE == xTaskCheckForTimeOut(&start, &timeout) || pdTRUE != xSemaphoreTake(bus_space, timeout) ||
+                pdTRUE == xTaskCheckForTimeOut(&start, &timeout) || pdTRUE != xSemaphoreTake(bus_sem, timeout)) {
+                return false;
+            }
+        }
+
+        bus_ring[bus_head % STATE_BUS_DEPTH] = events[i];
+        __atomic_store_n(&bus_head, bus_head + 1, __ATOMIC_SEQ_CST);
+    }
+
+    bus_wake_sleepers();
+    xSemaphoreGive(bus_sem);
+    return true;
+}
+
+/**********************************************************
+*                                            KEYED EVENTS *
+**********************************************************/
+
+// Binds keys[i] to handles[i], so state_post_keyed_event(keys[i], ...) reaches
+// that instance alone. A key already bound is moved to the new instance. The
+// keys of an instance are unbound when it is stopped. Returns false, binding
+// nothing, if the table would fill past 3/4 of STATE_KEY_TABLE_SIZE.
+bool state_bind_keys(const uint32_t* keys, const state_handle_t* handles, size_t total) {
+    if (!keys || !handles) {
+        ESP_LOGE(TAG, "ARG==NULL!");
+        ASSERT(0);
+    }
+
+    if (pdTRUE != xSemaphoreTake(consumer_sem, SATE_MUTEX_WAIT)) {
+        ESP_LOGE(TAG, "FAILED TO TAKE consumer_sem!");
+        ASSERT(0);
+    }
+
+    if (keys_bound + total > STATE_KEY_TABLE_SIZE / 4 * 3) {
+        xSemaphoreGive(consumer_sem);
+        ESP_LOGE(TAG, "Out of keys, raise STATE_KEY_TABLE_SIZE!");
+        return false;
+    }
+
+    for (size_t i = 0; i < total; i++) {
+        uint32_t at = key_find(keys[i]);
+        if (key_table[at].node) {
+            key_table[at].node->total_keys--;
+        } else {
+            key_table[at].key = keys[i];
+            keys_bound++;
+        }
+        key_table[at].node = handles[i];
+        handles[i]->total_keys++;
+    }
+
+    xSemaphoreGive(consumer_sem);
+    return true;
+}
+
+// Unbinds keys, keys that are not bound are skipped
+void state_unbind_keys(const uint32_t* keys, size_t total) {
+    if (!keys) {
+        ESP_LOGE(TAG, "ARG==NULL!");
+        ASSERT(0);
+    }
+
+    if (pdTRUE != xSemaphoreTake(consumer_sem, SATE_MUTEX_WAIT)) {
+        ESP_LOGE(TAG, "FAILED TO TAKE consumer_sem!");
+        ASSERT(0);
+    }
+
+    for (size_t i = 0; i < total; i++) {
+        uint32_t at = key_find(keys[i]);
+        if (key_table[at].node) {
+            key_erase(at);
+        }
+    }
+
+    xSemaphoreGive(consumer_sem);
+}
+
+// Sends event straight to the event queue of the instance bound to key,
+// bypassing the event_multiplexer and filter_event. Never blocks, returns
+// false if no instance is bound to key or its queue is full.
+bool state_post_keyed_event(uint32_t key, state_event_t event) {
+    if (event >= STATE_FLAG_EVENT_START) {
+        ESP_LOGE(TAG, "Event %u can't be used as a keyed event!", event);
+        ASSERT(0);
+    }
+
+    // consumer_sem keeps the instance from being stopped under us
+    if (pdTRUE != xSemaphoreTake(consumer_sem, SATE_MUTEX_WAIT)) {
+        ESP_LOGE(TAG, "FAILED TO TAKE consumer_sem!");
+        ASSERT(0);
+    }
+
+    node_t* node = key_table[key_find(key)].node;
+    bool    sent = node && pdTRUE == xQueueSendToBack(node->queue, &event, RTOS_DONT_WAIT);
+
+#ifdef POSIX_FREERTOS_SIM
+    if (sent) {
+        state_journal_append(event, key);
+    }
+#endif
+
+    xSemaphoreGive(consumer_sem);
+    return sent;
+}
+
+/**********************************************************
+*                                             CHECKPOINTS *
+**********************************************************/
+// A checkpoint image is a header, a record per machine, then a record per
+// pending delayed event. All fields are 32 bit words in host byte order, the
+// checksum is FNV-1a over the image with the checksum field zeroed.
+//
+// header:  magic, version, total_machines, total_timers, length, checksum
+// machine: name hash, state, context_size, context (padded to 4 bytes)
+// timer:   event, ticks left
+#define CHECKPOINT_HEADER_WORDS (6)
+#define CHECKPOINT_CHECKSUM_AT  (5 * sizeof(uint32_t))
+
+static uint32_t fnv1a(uint32_t hash, const uint8_t* data, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ data[i]) * 16777619u;
+    }
+    return hash;
+}
+
+static uint32_t name_hash(const char* name) {
+    return fnv1a(2166136261u, (const uint8_t*)name, strlen(name));
+}
+
+static uint32_t image_checksum(const uint8_t* image, size_t len) {
+    static const uint8_t zero[sizeof(uint32_t)];
+
+    uint32_t hash = fnv1a(2166136261u, image, CHECKPOINT_CHECKSUM_AT);
+    hash          = fnv1a(hash, zero, sizeof(zero));
+    return fnv1a(hash, image + CHECKPOINT_CHECKSUM_AT + sizeof(uint32_t), len - CHECKPOINT_CHECKSUM_AT - sizeof(uint32_t));
+}
+
+static uint32_t get_word(const uint8_t* image, size_t at) {
+    uint32_t word;
+    memcpy(&word, image + at, sizeof(word));
+    return word;
+}
+
+// Appends a word if there is room, returns the new write position
+static size_t put_word(uint8_t* image, size_t size, size_t at, uint32_t word) {
+    if (at + sizeof(word) <= size) {
+        memcpy(image + at, &word, sizeof(word));
+    }
+    return at + sizeof(word);
+}
+
+static size_t context_words(size_t context_size) {
+    return (context_size + sizeof(uint32_t) - 1) / sizeof(uint32_t);
+}
+
+// Returns the image length if image is a valid checkpoint, 0 otherwise
+static size_t checkpoint_validate(const uint8_t* image, size_t len) {
+    if (!image || len < CHECKPOINT_HEADER_WORDS * sizeof(uint32_t)) {
+        return 0;
+    }
+
+    if (get_word(image, 0) != STATE_CHECKPOINT_MAGIC || get_word(image, 4) != STATE_CHECKPOINT_VERSION) {
+        ESP_LOGW(TAG, "Checkpoint has the wrong magic / version");
+        return 0;
+    }
+
+    size_t image_len = get_word(image, 16);
+    if (image_len > len || image_len < CHECKPOINT_HEADER_WORDS * sizeof(uint32_t) ||
+        get_word(image, CHECKPOINT_CHECKSUM_AT) != image_checksum(image, image_len)) {
+        ESP_LOGW(TAG, "Checkpoint is truncated or corrupt");
+        return 0;
+    }
+
+    return image_len;
+}
+
+// Writes the current state, context and pending delayed events of every
+// state machine into image. Returns the image length, or 0 if size is too
+// small. Best taken while the machines are idle, each machine is captured
+// atomically but not all of them at the same instant.
+size_t state_checkpoint(uint8_t* image, size_t size) {
+    size_t   at             = CHECKPOINT_HEADER_WORDS * sizeof(uint32_t);
+    uint32_t total_machines = 0;
+    uint32_t total_timers   = 0;
+
+    if (!image) {
+        ESP_LOGE(TAG, "ARG==NULL!");
+        ASSERT(0);
+    }
+
+    if (pdTRUE != xSemaphoreTake(consumer_sem, SATE_MUTEX_WAIT)) {
+        ESP_LOGE(TAG, "FAILED TO TAKE consumer_sem!");
+        ASSERT(0);
+    }
+
+    for (node_t* iter = head; iter != NULL; iter = iter->next) {
+        state_init_s* state_ptr    = iter->thread_info;
+        size_t        context_size = iter->context ? state_ptr->context_size : 0;
+        uint8_t       context[STATE_CHECKPOINT_MAX_CONTEXT] = { 0 };
+
+        if (context_size > STATE_CHECKPOINT_MAX_CONTEXT) {
+            ESP_LOGE(TAG, "Context of %s is over STATE_CHECKPOINT_MAX_CONTEXT!", state_ptr->state_name_string);
+            ASSERT(0);
+        }
+
+        taskENTER_CRITICAL();
+        state_t state = iter->state;
+        memcpy(context, iter->context, context_size);
+        taskEXIT_CRITICAL();
+
+        at = put_word(image, size, at, name_hash(state_ptr->state_name_string));
+        at = put_word(image, size, at, state);
+        at = put_word(image, size, at, context_size);
+        for (size_t word = 0; word < context_words(context_size); word++) {
+            at = put_word(image, size, at, get_word(context, word * sizeof(uint32_t)));
+        }
+        total_machines++;
+    }
+
+    xSemaphoreGive(consumer_sem);
+
+    xSemaphoreTake(timer_sem, portMAX_DELAY);
+    TickType_t now = xTaskGetTickCount();
+    for (int i = 0; i < timer_heap_len; i++) {
+        timed_event_t* timed = &timed_events[timer_heap[i]];
+        at = put_word(image, size, at, timed->event);
+        at = put_word(image, size, at, STATE_DEADLINE_BEFORE(now, timed->deadline) ? timed->deadline - now : 0);
+        total_timers++;
+    }
+    xSemaphoreGive(timer_sem);
+
+    if (at > size) {
+        ESP_LOGE(TAG, "Checkpoint needs %u bytes, only have %u", (unsigned)at, (unsigned)size);
+        return 0;
+    }
+
+    put_word(image, size, 0, STATE_CHECKPOINT_MAGIC);
+    put_word(image, size, 4, STATE_CHECKPOINT_VERSION);
+    put_word(image, size, 8, total_machines);
+    put_word(image, size, 12, total_timers);
+    put_word(image, size, 16, at);
+    put_word(image, size, CHECKPOINT_CHECKSUM_AT, image_checksum(image, at));
+    return at;
+}
+
+// Starts a state machine where a checkpoint left it: in its saved state, with
+// its context restored. Falls back to starting_state if the image is invalid
+// or holds no record of the machine.
+state_handle_t start_new_state_machine_restore(state_init_s* state_ptr, const uint8_t* image, size_t len) {
+    if (!state_ptr) {
+        ESP_LOGE(TAG, "ARG==NULL!");
+        ASSERT(0);
+    }
+    return start_state_machine_instance_restore(state_ptr, state_ptr->context, default_storage(state_ptr), image, len);
+}
+
+// Instance flavour of start_new_state_machine_restore(). When a definition
+// ran several instances, each call restores the next record saved for it.
+state_handle_t start_state_machine_instance_restore(state_init_s* state_ptr, void* context, state_storage_s* storage,
+                                                    const uint8_t* image, size_t len) {
+    if (!state_ptr) {
+        ESP_LOGE(TAG, "ARG==NULL!");
+        ASSERT(0);
+    }
+
+    size_t image_len = checkpoint_validate(image, len);
+    if (!image_len) {
+        return start_state_machine(state_ptr, state_ptr->starting_state, context, storage);
+    }
+
+    // Records of the instances already running are skipped
+    int skip = 0;
+    if (pdTRUE != xSemaphoreTake(consumer_sem, SATE_MUTEX_WAIT)) {
+        ESP_LOGE(TAG, "FAILED TO TAKE consumer_sem!");
+        ASSERT(0);
+    }
+    for (node_t* iter = head; iter != NULL; iter = iter->next) {
+        skip += iter->thread_info == state_ptr;
+    }
+    xSemaphoreGive(consumer_sem);
+
+    uint32_t hash           = name_hash(state_ptr->state_name_string);
+    uint32_t total_machines = get_word(image, 8);
+    size_t   at             = CHECKPOINT_HEADER_WORDS * sizeof(uint32_t);
+
+    for (uint32_t i = 0; i < total_machines && at + 3 * sizeof(uint32_t) <= image_len; i++) {
+        uint32_t record_hash  = get_word(image, at);
+        state_t  state        = get_word(image, at + 4);
+        size_t   context_size = get_word(image, at + 8);
+        at += 3 * sizeof(uint32_t);
+
+        if (record_hash == hash && skip-- == 0 && state < state_ptr->total_states && at + context_size <= image_len) {
+            if (context_size != (context ? state_ptr->context_size : 0)) {
+                ESP_LOGW(TAG, "Context of %s changed size, not restoring it", state_ptr->state_name_string);
+            } else {
+                memcpy(context, image + at, context_size);
+            }
+            ESP_LOGI(TAG, "Restoring %s in state %u", state_ptr->state_name_string, state);
+            return start_state_machine(state_ptr, state, context, storage);
+        }
+        at += context_words(context_size) * sizeof(uint32_t);
+    }
+
+    ESP_LOGW(TAG, "No checkpoint of %s, cold starting", state_ptr->state_name_string);
+    return start_state_machine(state_ptr, state_ptr->starting_state, context, storage);
+}
+
+// Re-arms the delayed events pending when the checkpoint was taken, with the
+// ticks they had left. Call after state_core_spawner().
+void state_restore_timers(const uint8_t* image, size_t len) {
+    size_t image_len = checkpoint_validate(image, len);
+    if (!image_len) {
+        return;
+    }
+
+    uint32_t total_machines = get_word(image, 8);
+    uint32_t total_timers   = get_word(image, 12);
+    size_t   at             = CHECKPOINT_HEADER_WORDS * sizeof(uint32_t);
+
+    // Skip the machine records
+    for (uint32_t i = 0; i < total_machines && at + 3 * sizeof(uint32_t) <= image_len; i++) {
+        at += 3 * sizeof(uint32_t) + context_words(get_word(image, at + 8)) * sizeof(uint32_t);
+    }
+
+    for (uint32_t i = 0; i < total_timers && at + 2 * sizeof(uint32_t) <= image_len; i++) {
+        state_post_event_after(get_word(image, at), get_word(image, at + 4));
+        at += 2 * sizeof(uint32_t);
+    }
+}
@@ -2,13 +2,100 @@
 
 #include "FreeRTOS.h"
 #include "queue.h"
+#include "semphr.h"
+#include "message_buffer.h"
 #include "stdbool.h"
 
+/**********************************************************
+*                      DEFINES
+**********************************************************/
+#define GENERIC_QUEUE_TIMEOUT  (2500 / portTICK_PERIOD_MS)
+#define INVALID_EVENT          (0xFFFFFFFF)
+#define EVENT_QUEUE_MAX_DEPTH  (16)
+#define SATE_MUTEX_WAIT        (2500 / portTICK_PERIOD_MS)
+#define NULL_STATE             (0xFFFF)
+#define STATE_STATS_MAX_STATES (16) // States per machine covered by state_stats_s
+
+#define STATE_MULTIPLEXER_STACK_DEPTH (4096) // In words
+#define STATE_MULTIPLEXER_PRIORITY    (4)
+#define STATE_MACHINE_STACK_DEPTH     (4096) // In words, if state_init_s does not set one
+#define STATE_MACHINE_PRIORITY        (4)    // If state_init_s does not set one
+#define STATE_STACK_MARGIN_PERCENT    (25)   // Headroom added to the recommended stack sizes
+
+// Set to one to have state_core do no heap work at all. Every state machine
+// must then provide its storage through state_init_s (see
+// STATE_MACHINE_STATIC_STORAGE), and at most STATE_CORE_MAX_MACHINES machines
+// can be started.
+#define STATE_CORE_STATIC_ALLOCATION (0)
+#define STATE_CORE_MAX_MACHINES      (16)
+
+// Flag events. Bit n of a flag word posted with state_post_flags() reaches
+// next_state as the event STATE_FLAG_EVENT(n). Posted flags collect in a task
+// notification index of their own, so index 0 stays free for application
+// code. configTASK_NOTIFICATION_ARRAY_ENTRIES must cover it.
+#define STATE_FLAG(bit)           (1u << (bit))
+#define STATE_FLAG_EVENT_START    (0x20000000)
+#define STATE_FLAG_EVENT(bit)     (STATE_FLAG_EVENT_START + (bit))
+#define STATE_IS_FLAG_EVENT(e)    ((state_event_t)((e) - STATE_FLAG_EVENT_START) < 32)
+#define STATE_FLAG_NOTIFY_INDEX   (2) // Task notification index the flags collect in
+
+// Length of the queue set a state machine waits on when it has inputs other
+// than its event queue (event queue + doorbell + additional sources)
+#define STATE_SOURCES_MAX_LENGTH  (16) // Sum of the lengths of a machine's sources
+#define STATE_SET_MAX_LENGTH      (EVENT_QUEUE_MAX_DEPTH + 1 + STATE_SOURCES_MAX_LENGTH)
+
+// Delayed events, see state_post_event_after()
+#define STATE_MAX_TIMED_EVENTS    (32) // Delayed events pending at once, at most 256
+#define STATE_TIMER_INVALID       (0)  // Never returned as a valid state_timer_t
+
+// Synchronous calls, see state_call(). A call travels through the event queue
+// of the target as STATE_CALL_EVENT_FLAG | slot << STATE_CALL_SLOT_SHIFT | event,
+// so events used with state_call() must fit in STATE_CALL_EVENT_MASK
+#define STATE_MAX_CALLS           (32) // Calls in flight at once, at most 32
+#define STATE_CALL_EVENT_FLAG     (0x40000000)
+#define STATE_CALL_SLOT_SHIFT     (24)
+#define STATE_CALL_EVENT_MASK     (0x00FFFFFF)
+#define STATE_CALL_NOTIFY_INDEX   (1)  // Task notification index the caller blocks on
+#define STATE_TLS_INDEX           (0)  // Thread local storage slot holding the running machine
+
+// Variable length messages, see state_post_message()
+#define STATE_MSG_MAX_PAYLOAD     (128) // Bytes
+
+// Range routing, see state_range_s
+#define STATE_ROUTE_MAX_SLOTS     (256) // Machines running at once, multiple of 32
+#define STATE_ROUTE_MAX_SEGMENTS  (128) // Distinct range boundaries across all machines, minus one
+#define STATE_NAMESPACE_SIZE      (100) // Spacing of the *_EVENT_START namespaces in global_defines.h
+#define STATE_MAX_NAMESPACES      (32)  // Events of higher namespaces are accepted by every state
+
+// Events the event_multiplexer could not queue to a slow state machine wait
+// in its overflow ring, the event_multiplexer never blocks on a machine
+#define STATE_OVERFLOW_DEPTH       (32) // Events per machine, dropped beyond that
+#define STATE_OVERFLOW_RETRY_TICKS (1)  // Retry period while events are waiting
+#define STATE_DEFER_DEPTH          (16) // Deferred events per machine
+
+// Broadcast bus, see state_bus_publish()
+#define STATE_BUS_DEPTH           (256) // Events in the ring, power of two
+
+// Keyed events, see state_post_keyed_event()
+#define STATE_KEY_TABLE_SIZE      (512) // Power of two, at most 3/4 of it can be bound
+
+// Event taps, see state_add_event_tap()
+#define STATE_MAX_TAPS            (4)
+
+// Checkpoints, see state_checkpoint()
+#define STATE_CHECKPOINT_MAGIC       (0x53434B50) // "SCKP"
+#define STATE_CHECKPOINT_VERSION     (1)          // Bump whenever the image layout changes
+#define STATE_CHECKPOINT_MAX_CONTEXT (64)         // Bytes of user context per machine
+
 /*********************************************************
 *                     TYPEDEFS
 **********************************************************/
-typedef uint32_t state_event_t; // Which event
+typedef uint32_t state_event_t; // Which event, must be below STATE_FLAG_EVENT_START
 typedef uint32_t state_t;       // Which state in a state machine
+typedef uint32_t state_timer_t; // Handle of a delayed event, used to cancel it
+
+// Handle of a running state machine, returned by start_new_state_machine()
+typedef struct state_node* state_handle_t;
 
 // Individual state functions in a state machine
 typedef state_t (*func_ptr)(void);
@@ -23,9 +110,87 @@ typedef struct {
     // If non-zero, the period of a loop (in ticks)
     uint32_t loop_timer;
 
+    // Namespaces of the events the state handles, see STATE_NAMESPACE_BIT.
+    // While the machine is in this state, events of other namespaces are not
+    // delivered to it. 0 accepts every event.
+    uint32_t namespaces;
+
+    // Events the state postpones, bit n stands for event defer_event_base + n
+    // of the state_init_s. They are held back, and delivered again in order
+    // after the next state change. See STATE_DEFER_BIT.
+    uint32_t defer;
+
 } state_array_s;
 
-// Init function, used to set up a state machine
+// An additional input of a state machine, such as a private command queue or a
+// semaphore given by a driver. Stream and message buffers can not be members of
+// a queue set, have their writer give a binary semaphore source instead.
+typedef struct {
+    // Queue or semaphore the state machine also waits on
+    QueueSetMemberHandle_t handle;
+
+    // Number of items the source holds, 1 for a binary semaphore
+    UBaseType_t length;
+
+    // Called on the state machine task when the source is ready. It must take
+    // the item (xQueueReceive / xSemaphoreTake without waiting) and return
+    // the event to hand to next_state, or INVALID_EVENT to keep waiting
+    state_event_t (*on_ready)(QueueSetMemberHandle_t handle);
+
+} state_source_s;
+
+// Inclusive range of events a state machine subscribes to, see
+// STATE_RANGE / STATE_NAMESPACE
+typedef struct {
+    state_event_t first;
+    state_event_t last;
+} state_range_s;
+
+// Called for every locally posted event in the ranges of the tap, on the task
+// routing the event: the event_multiplexer, or the caller of
+// state_post_events() which routes its batch itself. Either way the registry
+// lock is held, so calls never overlap and see events in the order they are
+// routed. Must not block, and must not post events or start / stop state
+// machines.
+typedef void (*state_tap_f)(state_event_t event, void* arg);
+
+// Header of a message posted with state_post_message(), followed by len bytes
+// of payload in the message buffer of the state machine
+typedef struct {
+    state_event_t event;
+    uint32_t      len;
+} state_msg_hdr_s;
+
+// Storage of one running instance of a state machine, only used when
+// STATE_CORE_STATIC_ALLOCATION is set
+typedef struct {
+    // Storage of the state machine input queue, must hold
+    // EVENT_QUEUE_MAX_DEPTH events
+    uint8_t*       queue_storage;
+    StaticQueue_t* queue_buffer;
+
+    // Storage of the state machine task, holds stack_depth words
+    StaticTask_t*  task_buffer;
+    StackType_t*   stack;
+
+    // Storage of the queue set and doorbell, used by machines with flags or
+    // sources.
+    // set_storage must hold STATE_SET_MAX_LENGTH handles
+    uint8_t*           set_storage;
+    StaticQueue_t*     set_buffer;
+    StaticSemaphore_t* doorbell_buffer;
+
+    // Storage of the message buffer, message_storage must hold
+    // message_buffer_size + 1 bytes. See STATE_MACHINE_STATIC_MESSAGES
+    uint8_t*               message_storage;
+    StaticMessageBuffer_t* message_buffer;
+    StaticSemaphore_t*     message_sem_buffer;
+
+} state_storage_s;
+
+// Init function, used to set up a state machine. This is only the definition
+// of the machine, state_core never writes to it, so it can be shared by any
+// number of running instances (see start_state_machine_instance()).
 typedef struct {
 
     // This is the function that calculates the next state, based on input
@@ -34,11 +199,6 @@ typedef struct {
     // happen based on input events.
     void (*next_state)(state_t*, state_event_t);
 
-    // This must never be set by the user! This is a pointer to the queue 
-    // which reads events into the state machine. If get_event is not provided, this 
-    // queue will be used internally with a generic event receive function
-    QueueHandle_t state_queue_input_handle_private;  
-
     // Translates a event to a string (just for debug)
     char* (*event_print)(state_event_t);
 
@@ -52,6 +212,16 @@ typedef struct {
     // can decide what events to react too
     bool (*filter_event)(state_event_t);
 
+    // First event of the state_array_s.defer masks
+    state_event_t defer_event_base;
+
+    // Event ranges the state machine subscribes to. The event_multiplexer
+    // finds the subscribers of an event through an interval index, rather
+    // than asking every machine. If set, filter_event is optional and only
+    // narrows down the events in the ranges.
+    const state_range_s* subscriptions;
+    int                  total_subscriptions;
+
     // This is a pointer to a state array as such
     // state_array_s func_table[parser_state_len] = { 
     //    { state_function_pointer_a, int ticks_a },
@@ -65,25 +235,190 @@ typedef struct {
     // Total number of states
     int total_states;
 
+    // Flags (level signals such as link-up) this state machine reacts to, see
+    // state_post_flags(). Pending flags never take up queue slots, a flag
+    // posted many times before the machine runs is delivered once. Pending
+    // flags are delivered before queued events, lowest bit first.
+    uint32_t flag_mask;
+
+    // Additional inputs, the state machine wakes on whichever of its event
+    // queue, flags and sources is ready first. The sources must be empty when
+    // the machine is started.
+    state_source_s* sources;
+    int             total_sources;
+
+    // If non-zero, the size in bytes of a message buffer carrying variable
+    // length messages (state_post_message()) into the state machine. Each
+    // message takes sizeof(state_msg_hdr_s) + payload + sizeof(size_t) bytes.
+    size_t message_buffer_size;
+
+    // If set, the state machine reads the events published with
+    // state_bus_publish(), filtered by filter_event if it has one
+    bool bus_subscriber;
+
+    // Small user context of the state machine, saved by state_checkpoint() and
+    // restored by start_new_state_machine_restore(). At most
+    // STATE_CHECKPOINT_MAX_CONTEXT bytes, must not hold pointers. Instances
+    // started with start_state_machine_instance() bring their own context of
+    // context_size bytes, see state_context().
+    void*  context;
+    size_t context_size;
+
+    // Stack size of the state machine task in words, and its priority. If
+    // zero, STATE_MACHINE_STACK_DEPTH / STATE_MACHINE_PRIORITY are used. See
+    // state_core_stack_report() for sizing the stack.
+    uint32_t    stack_depth;
+    UBaseType_t priority;
+
+#if (STATE_CORE_STATIC_ALLOCATION == 1)
+    // Storage of the instance started by start_new_state_machine()
+    state_storage_s storage;
+#endif
+
 } state_init_s;
 
+// Time spent in, and transitions between, the states of a state machine.
+// Only the first STATE_STATS_MAX_STATES states of a machine are accounted.
+typedef struct {
+    // Wall time spent in each state (ns)
+    uint64_t wall_time_ns[STATE_STATS_MAX_STATES];
+
+    // Run time of the state machine task while in each state (ns), as
+    // accounted by the kernel at context switches
+    uint64_t cpu_time_ns[STATE_STATS_MAX_STATES];
+
+    // Number of times each state was entered
+    uint32_t entries[STATE_STATS_MAX_STATES];
+
+    // transitions[from][to], including states forcing themselves again
+    uint32_t transitions[STATE_STATS_MAX_STATES][STATE_STATS_MAX_STATES];
+
+    // Events that found the event queue full and waited in the overflow
+    // ring, and events dropped because the ring was full too
+    uint32_t overflowed_events;
+    uint32_t dropped_events;
+
+    // Events a state deferred, and deferred events that found no room and
+    // were handed to next_state right away
+    uint32_t deferred_events;
+    uint32_t defer_overflows;
+
+} state_stats_s;
+
+/**********************************************************
+*                        HELPERS
+**********************************************************/
+// Subscriptions, for example
+//
+// static const state_range_s parser_subscriptions[] = {
+//     STATE_NAMESPACE(PARSER_CORE_EVENT_START),
+//     STATE_RANGE(NETWORK_EVENT_START, NETWORK_EVENT_START + 9),
+// };
+#define STATE_RANGE(first, last) { (first), (last) }
+#define STATE_NAMESPACE(start)   { (start), (start) + STATE_NAMESPACE_SIZE - 1 }
+
+// Bit of a namespace in state_array_s.namespaces, e.g
+// { parser_idle_func, portMAX_DELAY, STATE_NAMESPACE_BIT(PARSER_CORE_EVENT_START) }
+#define STATE_NAMESPACE_BIT(start) (1u << ((start) / STATE_NAMESPACE_SIZE))
+
+// Bit of an event in state_array_s.defer, e.g
+// { parser_busy_func, portMAX_DELAY, 0, STATE_DEFER_BIT(PARSER_CORE_EVENT_START, PARSER_REQUEST) }
+#define STATE_DEFER_BIT(base, event) (1u << ((event) - (base)))
+
+// True if tick deadline a is before deadline b, handles tick wrap around
+#define STATE_DEADLINE_BEFORE(a, b) ((int32_t)((TickType_t)(a) - (TickType_t)(b)) < 0)
+
+#if (STATE_CORE_STATIC_ALLOCATION == 1)
+// Declares the storage of a state machine, for example
+//
+// STATE_MACHINE_STATIC_STORAGE(parser, 2048);
+// static state_init_s parser_state = {
+//     ...
+//     STATE_MACHINE_STATIC_INIT(parser),
+// };
+ #define STATE_MACHINE_STATIC_STORAGE(name, depth)                                   \
+     static uint8_t           name##_queue_storage[EVENT_QUEUE_MAX_DEPTH * sizeof(state_event_t)]; \
+     static StaticQueue_t     name##_queue_buffer;                                   \
+     static StaticTask_t      name##_task_buffer;                                    \
+     static StackType_t       name##_stack[depth];                                   \
+     static uint8_t           name##_set_storage[STATE_SET_MAX_LENGTH * sizeof(QueueSetMemberHandle_t)]; \
+     static StaticQueue_t     name##_set_buffer;                                     \
+     static StaticSemaphore_t name##_doorbell_buffer
+
+ #define STATE_MACHINE_STATIC_INIT(name)                                             \
+     .storage.queue_storage   = name##_queue_storage,                                \
+     .storage.queue_buffer    = &name##_queue_buffer,                                \
+     .storage.task_buffer     = &name##_task_buffer,                                 \
+     .storage.stack           = name##_stack,                                        \
+     .stack_depth             = sizeof(name##_stack) / sizeof(StackType_t),          \
+     .storage.set_storage     = name##_set_storage,                                  \
+     .storage.set_buffer      = &name##_set_buffer,                                  \
+     .storage.doorbell_buffer = &name##_doorbell_buffer
+
+// Declares the storage of a message buffer of size bytes, used together with
+// STATE_MACHINE_STATIC_STORAGE
+ #define STATE_MACHINE_STATIC_MESSAGES(name, size)                                   \
+     static uint8_t               name##_message_storage[(size) + 1];                \
+     static StaticMessageBuffer_t name##_message_buffer;                             \
+     static StaticSemaphore_t     name##_message_sem_buffer
+
+ #define STATE_MACHINE_STATIC_MESSAGES_INIT(name)                                    \
+     .message_buffer_size        = sizeof(name##_message_storage) - 1,               \
+     .storage.message_storage    = name##_message_storage,                           \
+     .storage.message_buffer     = &name##_message_buffer,                           \
+     .storage.message_sem_buffer = &name##_message_sem_buffer
+
+// Further instances of a definition each need a state_storage_s of their own,
+// for example with the buffers of STATE_MACHINE_STATIC_STORAGE(conn_1, 2048)
+//
+// static state_storage_s conn_1_storage = {
+//     .queue_storage = conn_1_queue_storage,
+//     .queue_buffer  = &conn_1_queue_buffer,
+//     ...
+// };
+// start_state_machine_instance(&conn_definition, &conn_1_context, &conn_1_storage);
+#endif
+
+// Fails the build if an application starts more machines than the core has
+// room for, e.g STATE_CORE_CHECK_MACHINE_COUNT(test_machines_len);
+#define STATE_CORE_CHECK_MACHINE_COUNT(count) \
+    _Static_assert((count) <= STATE_CORE_MAX_MACHINES, "Raise STATE_CORE_MAX_MACHINES")
+
 /**********************************************************
 *                   GLOBAL FUNCTIONS
 **********************************************************/
 void state_post_event(state_event_t event);
+void state_post_flags(uint32_t flags);
+size_t state_post_events(const state_event_t* events, size_t total);
+size_t state_post_remote_events(const state_event_t* events, size_t total);
+bool state_post_remote_event(state_event_t event);
+bool state_add_event_tap(const state_range_s* ranges, int total_ranges, state_tap_f tap, void* arg);
+state_timer_t state_post_event_after(state_event_t event, TickType_t delay);
+state_timer_t state_post_event_at(state_event_t event, TickType_t tick);
+bool state_cancel_event(state_timer_t timer);
 void state_core_spawner();
-void start_new_state_machine(state_init_s* state_ptr);
+state_handle_t start_new_state_machine(state_init_s* state_ptr);
+state_handle_t start_state_machine_instance(state_init_s* state_ptr, void* context, state_storage_s* storage);
+bool stop_state_machine(state_handle_t handle);
+bool state_bind_keys(const uint32_t* keys, const state_handle_t* handles, size_t total);
+void state_unbind_keys(const uint32_t* keys, size_t total);
+bool state_post_keyed_event(uint32_t key, state_event_t event);
+bool state_bus_publish(const state_event_t* events, size_t total, TickType_t timeout);
+void* state_context(void);
+bool state_call(state_handle_t handle, state_event_t event, uint32_t* reply, TickType_t timeout);
+bool state_reply(uint32_t value);
+bool state_post_message(state_handle_t handle, state_event_t event, const void* payload, size_t len, TickType_t timeout);
+const void* state_message_payload(size_t* len);
+size_t state_checkpoint(uint8_t* image, size_t size);
+state_handle_t start_new_state_machine_restore(state_init_s* state_ptr, const uint8_t* image, size_t len);
+state_handle_t start_state_machine_instance_restore(state_init_s* state_ptr, void* context, state_storage_s* storage,
+                                                    const uint8_t* image, size_t len);
+void state_restore_timers(const uint8_t* image, size_t len);
+bool state_core_get_stats(state_handle_t handle, state_stats_s* stats);
+void state_core_dump_stats(void);
+void state_core_stack_report(void);
 
 /**********************************************************
 *                      GLOBALS    
 *********************************************************/
 extern QueueHandle_t events_net_q;
-
-/**********************************************************
-*                      DEFINES
-**********************************************************/
-#define GENERIC_QUEUE_TIMEOUT (2500 / portTICK_PERIOD_MS)
-#define INVALID_EVENT         (0xFFFFFFFF)
-#define EVENT_QUEUE_MAX_DEPTH (16)
-#define SATE_MUTEX_WAIT       (2500 / portTICK_PERIOD_MS)
-#define NULL_STATE            (0xFFFF)
@@ -0,0 +1,348 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "FreeRTOS.h"
+#include "semphr.h"
+#include "task.h"
+
+#include "global_defines.h"
+#include "state_core.h"
+#include "state_federation.h"
+
+#ifdef POSIX_FREERTOS_SIM
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+/**********************************************************
+*                                                 DEFINES *
+**********************************************************/
+#define FED_DATAGRAM_SIZE (sizeof(state_fed_datagram_s) + STATE_FED_MAX_BATCH * sizeof(state_event_t))
+
+/**********************************************************
+*                                                TYPEDEFS *
+**********************************************************/
+typedef struct {
+    bool     used;
+    uint32_t node_id;
+    uint32_t epoch;
+    uint32_t next_seq;
+} fed_source_t;
+
+/**********************************************************
+*                                        STATIC VARIABLES *
+**********************************************************/
+static const char TAG[] = "STATE_FED";
+
+static int               fed_fd = -1;
+static uint32_t          fed_node_id;
+static uint32_t          fed_epoch;
+static TaskHandle_t      fed_task;
+static state_fed_stats_s fed_stats;
+
+// Outgoing batch and peers, guarded by fed_sem. The event tap runs holding
+// consumer_sem and only tries it, fed_sem must never be held while posting
+// events.
+static SemaphoreHandle_t  fed_sem;
+static struct sockaddr_in peers[STATE_FED_MAX_PEERS];
+static int                total_peers;
+static uint32_t           tx_seq;
+static union {
+    state_fed_datagram_s datagram;
+    uint8_t              bytes[FED_DATAGRAM_SIZE];
+} tx;
+
+// Only used by the federation task
+static fed_source_t sources[STATE_FED_MAX_SOURCES];
+static union {
+    state_fed_datagram_s datagram;
+    uint8_t              bytes[FED_DATAGRAM_SIZE];
+} rx[STATE_FED_RX_BURST];
+
+#if (STATE_CORE_STATIC_ALLOCATION == 1)
+static StaticSemaphore_t fed_sem_buffer;
+static StaticTask_t      fed_task_buffer;
+static StackType_t       fed_stack[STATE_FED_STACK_DEPTH];
+#endif
+
+/**********************************************************
+*                                               FUNCTIONS *
+**********************************************************/
+
+static void fed_take() {
+    if (pdTRUE != xSemaphoreTake(fed_sem, SATE_MUTEX_WAIT)) {
+        ESP_LOGE(TAG, "FAILED TO TAKE fed_sem!");
+        ASSERT(0);
+    }
+}
+
+// Sends the pending batch to every peer in one system call, must hold fed_sem
+static void fed_flush() {
+    struct mmsghdr messages[STATE_FED_MAX_PEERS];
+    struct iovec   iov;
+
+    if (!tx.datagram.count) {
+        return;
+    }
+
+    tx.datagram.magic   = STATE_FED_MAGIC;
+    tx.datagram.node_id = fed_node_id;
+    tx.datagram.epoch   = fed_epoch;
+    tx.datagram.seq     = tx_seq++;
+    iov.iov_base        = tx.bytes;
+    iov.iov_len         = sizeof(state_fed_datagram_s) + tx.datagram.count * sizeof(state_event_t);
+
+    memset(messages, 0, sizeof(messages));
+    for (int i = 0; i < total_peers; i++) {
+        messages[i].msg_hdr.msg_name    = &peers[i];
+        messages[i].msg_hdr.msg_namelen = sizeof(peers[i]);
+        messages[i].msg_hdr.msg_iov     = &iov;
+        messages[i].msg_hdr.msg_iovlen  = 1;
+    }
+
+    int sent = total_peers ? sendmmsg(fed_fd, messages, total_peers, MSG_DONTWAIT) : 0;
+    if (sent < total_peers) {
+        fed_stats.send_errors++;
+    }
+
+    fed_stats.sent_datagrams++;
+    fed_stats.sent_events += tx.datagram.count;
+    tx.datagram.count = 0;
+}
+
+// Event tap. It runs holding the registry lock on whichever task routes the
+// event, so it never waits for the batch and drops the event if it is busy.
+static void fed_forward(state_event_t event, void* arg) {
+    if (pdTRUE != xSemaphoreTake(fed_sem, 0)) {
+        if ((fed_stats.dropped_events++ & 0xFF) == 0) {
+            ESP_LOGW(TAG, "Batch busy, %u events dropped", fed_stats.dropped_events);
+        }
+        return;
+    }
+
+    tx.datagram.events[tx.datagram.count++] = event;
+    if (tx.datagram.count == STATE_FED_MAX_BATCH) {
+        fed_flush();
+    }
+    xSemaphoreGive(fed_sem);
+}
+
+// Sequence tracking of a sender, returns false if the datagram must be dropped
+static bool fed_check_sequence(const state_fed_datagram_s* datagram) {
+    fed_source_t* source = NULL;
+
+    for (int i = 0; i < STATE_FED_MAX_SOURCES && !source; i++) {
+        if (sources[i].used && sources[i].node_id == datagram->node_id) {
+            source = &sources[i];
+        }
+    }
+
+    if (!source) {
+        for (int i = 0; i < STATE_FED_MAX_SOURCES && !source; i++) {
+            if (!sources[i].used) {
+                source           = &sources[i];
+                source->used     = true;
+                source->node_id  = datagram->node_id;
+                source->epoch    = datagram->epoch;
+                source->next_seq = datagram->seq;
+            }
+        }
+        if (!source) {
+            if ((fed_stats.untracked_datagrams++ & 0xFF) == 0) {
+                ESP_LOGW(TAG, "Node %u not tracked, %u datagrams of untracked nodes, raise STATE_FED_MAX_SOURCES",
+                         datagram->node_id, fed_stats.untracked_datagrams);
+            }
+            return true;
+        }
+    }
+
+    // A sender starting over picks a new epoch, and its sequence with it
+    if (datagram->epoch != source->epoch) {
+        ESP_LOGW(TAG, "Node %u restarted", datagram->node_id);
+        fed_stats.restarts++;
+        source->epoch    = datagram->epoch;
+        source->next_seq = datagram->seq;
+    }
+
+    int32_t ahead = (int32_t)(datagram->seq - source->next_seq);
+    if (ahead < 0) {
+        fed_stats.late_datagrams++;
+        return false;
+    }
+
+    if (ahead > 0) {
+        ESP_LOGW(TAG, "Lost %d datagrams from node %u", ahead, datagram->node_id);
+        fed_stats.lost_datagrams += ahead;
+    }
+
+    source->next_seq = datagram->seq + 1;
+    return true;
+}
+
+// Reads a burst of datagrams in one system call and posts their events
+static void fed_receive() {
+    struct mmsghdr messages[STATE_FED_RX_BURST];
+    struct iovec   iov[STATE_FED_RX_BURST];
+
+    memset(messages, 0, sizeof(messages));
+    for (int i = 0; i < STATE_FED_RX_BURST; i++) {
+        iov[i].iov_base                = rx[i].bytes;
+        iov[i].iov_len                 = sizeof(rx[i].bytes);
+        messages[i].msg_hdr.msg_iov    = &iov[i];
+        messages[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    int received = recvmmsg(fed_fd, messages, STATE_FED_RX_BURST, MSG_DONTWAIT, NULL);
+    for (int i = 0; i < received; i++) {
+        state_fed_datagram_s* datagram = &rx[i].datagram;
+        size_t                len      = messages[i].msg_len;
+
+        if (len < sizeof(state_fed_datagram_s) || datagram->magic != STATE_FED_MAGIC ||
+            datagram->count > STATE_FED_MAX_BATCH ||
+            len != sizeof(state_fed_datagram_s) + datagram->count * sizeof(state_event_t)) {
+            ESP_LOGW(TAG, "Dropping malformed datagram");
+            continue;
+        }
+
+        if (datagram->node_id == fed_node_id || !fed_check_sequence(datagram)) {
+            continue;
+        }
+
+        fed_stats.received_datagrams++;
+        fed_stats.received_events += datagram->count;
+        state_post_remote_events(datagram->events, datagram->count);
+    }
+}
+
+// Federation task, receives and sends out the batch at least every
+// STATE_FED_FLUSH_TICKS. poll() never blocks, a task blocked in a system call
+// still looks Running to FreeRTOS and would starve lower priority tasks.
+static void fed_loop(void* arg) {
+    for (;;) {
+        struct pollfd fd = { .fd = fed_fd, .events = POLLIN };
+        bool          idle = poll(&fd, 1, 0) <= 0;
+
+        if (!idle) {
+            fed_receive();
+        }
+
+        fed_take();
+        fed_flush();
+        xSemaphoreGive(fed_sem);
+
+        if (idle) {
+            vTaskDelay(STATE_FED_FLUSH_TICKS);
+        }
+    }
+}
+
+// Joins the federation as node_id, listening on UDP port (any address).
+// Events posted locally in exports are sent to every peer, exports must stay
+// valid and may be NULL for a node that only listens.
+bool state_federation_start(uint32_t node_id, uint16_t port, const state_range_s* exports, int total_exports) {
+    if (total_exports && !exports) {
+        ESP_LOGE(TAG, "ARG==NULL!");
+        ASSERT(0);
+    }
+
+    if (fed_task) {
+        ESP_LOGW(TAG, "Federation already started");
+        return false;
+    }
+
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(port), .sin_addr.s_addr = htonl(INADDR_ANY) };
+
+    fed_fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fed_fd < 0 || bind(fed_fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        ESP_LOGE(TAG, "Failed to bind UDP port %u", port);
+        if (fed_fd >= 0) {
+            close(fed_fd);
+        }
+        fed_fd = -1;
+        return false;
+    }
+
+    // Bursts of datagrams must not overflow the socket while the task sleeps
+    int rcvbuf = 4 * 1024 * 1024;
+    setsockopt(fed_fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+    // Differs between runs of the node, so peers can tell it restarted
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    fed_node_id = node_id;
+    fed_epoch   = (uint32_t)now.tv_sec ^ (uint32_t)now.tv_nsec ^ ((uint32_t)getpid() << 16);
+
+#if (STATE_CORE_STATIC_ALLOCATION == 1)
+    if (!fed_sem) {
+        fed_sem = xSemaphoreCreateMutexStatic(&fed_sem_buffer);
+    }
+#else
+    if (!fed_sem) {
+        fed_sem = xSemaphoreCreateMutex();
+    }
+#endif
+    ASSERT(fed_sem);
+
+    // The tap goes first, nothing is left running if there is no room for it
+    // and the federation can be started again
+    if (total_exports && !state_add_event_tap(exports, total_exports, fed_forward, NULL)) {
+        close(fed_fd);
+        fed_fd = -1;
+        return false;
+    }
+
+#if (STATE_CORE_STATIC_ALLOCATION == 1)
+    fed_task = xTaskCreateStatic(fed_loop, "state_federation", STATE_FED_STACK_DEPTH, NULL, STATE_FED_PRIORITY,
+                                 fed_stack, &fed_task_buffer);
+#else
+    if (pdPASS != xTaskCreate(fed_loop, "state_federation", STATE_FED_STACK_DEPTH, NULL, STATE_FED_PRIORITY,
+                              &fed_task)) {
+        fed_task = NULL;
+    }
+#endif
+    ASSERT(fed_task);
+
+    ESP_LOGI(TAG, "Node %u federating on UDP port %u", node_id, port);
+    return true;
+}
+
+// Adds a node to send the exported events to, address is dotted IPv4
+// (e.g "127.0.0.1" to test on one host). Call after state_federation_start().
+bool state_federation_add_peer(const char* address, uint16_t port) {
+    struct sockaddr_in peer = { .sin_family = AF_INET, .sin_port = htons(port) };
+
+    if (!address || !fed_sem) {
+        ESP_LOGE(TAG, "Federation not started!");
+        ASSERT(0);
+    }
+
+    if (inet_pton(AF_INET, address, &peer.sin_addr) != 1) {
+        ESP_LOGE(TAG, "Bad peer address %s", address);
+        return false;
+    }
+
+    fed_take();
+    bool added = total_peers < STATE_FED_MAX_PEERS;
+    if (added) {
+        peers[total_peers++] = peer;
+    } else {
+        ESP_LOGW(TAG, "No room for peer %s, raise STATE_FED_MAX_PEERS", address);
+    }
+    xSemaphoreGive(fed_sem);
+    return added;
+}
+
+void state_federation_get_stats(state_fed_stats_s* stats) {
+    if (!stats) {
+        ESP_LOGE(TAG, "ARG==NULL!");
+        ASSERT(0);
+    }
+    *stats = fed_stats;
+}
+
+#endif
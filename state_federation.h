@@ -0,0 +1,64 @@
+#pragma once
+
+#include "state_core.h"
+
+/**********************************************************
+*                      DEFINES
+**********************************************************/
+#define STATE_FED_MAGIC        (0x53464544) // "SFED"
+#define STATE_FED_MAX_BATCH    (256)  // Events per datagram
+#define STATE_FED_MAX_PEERS    (8)
+#define STATE_FED_MAX_SOURCES  (16)   // Nodes tracked for gaps
+#define STATE_FED_RX_BURST     (16)   // Datagrams read per system call
+#define STATE_FED_FLUSH_TICKS  (1)    // Longest time an event waits for its batch
+#define STATE_FED_STACK_DEPTH  (4096) // In words
+#define STATE_FED_PRIORITY     (STATE_MULTIPLEXER_PRIORITY)
+
+/*********************************************************
+*                     TYPEDEFS
+**********************************************************/
+
+// Forwards events between nodes (hosts or containers) over UDP.
+//
+// Events posted locally in the export ranges are collected by an event tap
+// into a batch, which is sent to every peer in one sendmmsg() once it holds
+// STATE_FED_MAX_BATCH events, or at the latest STATE_FED_FLUSH_TICKS later. The
+// federation task reads up to STATE_FED_RX_BURST datagrams per recvmmsg()
+// and posts their events with state_post_remote_events(), so they are not
+// forwarded again. The tap never waits for the batch, an event posted while
+// the federation task is sending is dropped and counted.
+//
+// Every datagram carries the id of the node that sent it, the epoch it was
+// started in and a sequence number counted per sender. A receiver expecting
+// sequence n that gets n + k counts k lost datagrams, datagrams older than
+// expected are late and dropped. A new epoch means the sender
+// restarted, its sequence is followed from scratch. The sequence itself may
+// wrap. UDP does not retransmit, lost events stay lost.
+typedef struct {
+    uint32_t magic;
+    uint32_t node_id;
+    uint32_t epoch; // Picked when the node starts federating
+    uint32_t seq;
+    uint32_t count;
+    state_event_t events[];
+} state_fed_datagram_s;
+
+typedef struct {
+    uint32_t sent_datagrams;
+    uint32_t sent_events;
+    uint32_t dropped_events;      // Batch was busy when the tap ran
+    uint32_t send_errors;
+    uint32_t received_datagrams;
+    uint32_t received_events;
+    uint32_t lost_datagrams;      // Gaps in the sequence of a sender
+    uint32_t late_datagrams;      // Reordered or duplicated, dropped
+    uint32_t restarts;            // Senders seen starting a new epoch
+    uint32_t untracked_datagrams; // From senders beyond STATE_FED_MAX_SOURCES, not checked for gaps
+} state_fed_stats_s;
+
+/**********************************************************
+*                   GLOBAL FUNCTIONS
+**********************************************************/
+bool state_federation_start(uint32_t node_id, uint16_t port, const state_range_s* exports, int total_exports);
+bool state_federation_add_peer(const char* address, uint16_t port);
+void state_federation_get_stats(state_fed_stats_s* stats);
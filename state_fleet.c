@@ -0,0 +1,259 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "FreeRTOS.h"
+
+#include "global_defines.h"
+#include "state_core.h"
+#include "state_fleet.h"
+
+// The shuffle lookup is built for SSSE3 whatever the compiler flags, and
+// only used if the CPU running us has it
+#if defined(__x86_64__) || defined(__i386__)
+#include <tmmintrin.h>
+#define FLEET_SHUFFLE (1)
+#endif
+
+/**********************************************************
+*                                        STATIC VARIABLES *
+**********************************************************/
+static const char TAG[] = "STATE_FLEET";
+
+/**********************************************************
+*                                               FUNCTIONS *
+**********************************************************/
+
+// Builds the dense transition table by probing next_state
+static void fleet_build_transitions(state_fleet_s* fleet) {
+    state_init_s* machine = fleet->machine;
+
+    for (uint32_t event = 0; event < fleet->total_events; event++) {
+        fleet->moves[event] = false;
+
+        for (state_t from = 0; from < STATE_FLEET_MAX_STATES; from++) {
+            state_t to = from;
+            if (from < machine->total_states) {
+                machine->next_state(&to, fleet->event_base + event);
+            }
+
+            if (to >= machine->total_states && from < machine->total_states) {
+                ESP_LOGE(TAG, "%s moves to out of bounds state %u", machine->state_name_string, to);
+                ASSERT(0);
+            }
+
+            fleet->transitions[event][from] = to;
+            fleet->moves[event] |= to != from;
+        }
+    }
+}
+
+#ifdef FLEET_SHUFFLE
+// Up to 16 states, the row fits a register and one shuffle looks up the next
+// state of 16 instances at once. Returns the instances it did, a multiple of
+// 16, and adds the ones that moved to moved.
+__attribute__((target("ssse3")))
+static uint32_t fleet_apply_shuffle(const uint8_t* row, uint8_t* states, uint32_t total, uint32_t* moved) {
+    __m128i  lookup = _mm_loadu_si128((const __m128i*)row);
+    uint32_t i      = 0;
+
+    for (; i + 16 <= total; i += 16) {
+        __m128i from = _mm_loadu_si128((const __m128i*)&states[i]);
+        __m128i to   = _mm_shuffle_epi8(lookup, from);
+        *moved += 16 - __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(from, to)));
+        _mm_storeu_si128((__m128i*)&states[i], to);
+    }
+
+    return i;
+}
+#endif
+
+void state_fleet_init(state_fleet_s* fleet, state_init_s* machine, state_event_t event_base, uint32_t total_events,
+                      uint32_t capacity, uint8_t* states, TickType_t* deadlines, uint8_t* contexts) {
+    if (!fleet || !machine || !states || !deadlines || (machine->context_size && !contexts)) {
+        ESP_LOGE(TAG, "ARG==NULL!");
+        ASSERT(0);
+    }
+
+    // Sanity check(s)
+    if (machine->next_state == NULL) {
+        ESP_LOGE(TAG, "ERROR! next_state was NULL!");
+        ASSERT(0);
+    }
+
+    if (machine->total_states == 0 || machine->total_states > STATE_FLEET_MAX_STATES) {
+        ESP_LOGE(TAG, "Total states of %s must be 1..%d", machine->state_name_string, STATE_FLEET_MAX_STATES);
+        ASSERT(0);
+    }
+
+    if (machine->starting_state >= machine->total_states) {
+        ESP_LOGE(TAG, "Starting state of %s out of bounds", machine->state_name_string);
+        ASSERT(0);
+    }
+
+    if (total_events > STATE_FLEET_MAX_EVENTS || event_base + total_events > STATE_FLAG_EVENT_START) {
+        ESP_LOGE(TAG, "Events of %s must fit STATE_FLEET_MAX_EVENTS", machine->state_name_string);
+        ASSERT(0);
+    }
+
+    memset(fleet, 0, sizeof(state_fleet_s));
+    fleet->machine      = machine;
+    fleet->event_base   = event_base;
+    fleet->total_events = total_events;
+    fleet->capacity     = capacity;
+    fleet->states       = states;
+    fleet->deadlines    = deadlines;
+    fleet->contexts     = contexts;
+
+    fleet_build_transitions(fleet);
+}
+
+// Adds an instance in the starting state, with a copy of context (which may
+// be NULL). Returns its index, or -1 if the fleet is full.
+int32_t state_fleet_add(state_fleet_s* fleet, const void* context) {
+    if (fleet->total == fleet->capacity) {
+        ESP_LOGW(TAG, "Fleet of %s is full", fleet->machine->state_name_string);
+        return -1;
+    }
+
+    uint32_t instance          = fleet->total++;
+    size_t   context_size      = fleet->machine->context_size;
+    fleet->states[instance]    = fleet->machine->starting_state;
+    fleet->deadlines[instance] = STATE_FLEET_NO_DEADLINE;
+
+    if (context_size) {
+        if (context) {
+            memcpy(&fleet->contexts[instance * context_size], context, context_size);
+        } else {
+            memset(&fleet->contexts[instance * context_size], 0, context_size);
+        }
+    }
+
+    return instance;
+}
+
+// Removes an instance, the last instance takes over its index
+void state_fleet_remove(state_fleet_s* fleet, uint32_t instance) {
+    if (instance >= fleet->total) {
+        ESP_LOGE(TAG, "Instance %u of %s does not exist!", instance, fleet->machine->state_name_string);
+        ASSERT(0);
+    }
+
+    uint32_t last         = --fleet->total;
+    size_t   context_size = fleet->machine->context_size;
+
+    fleet->states[instance]    = fleet->states[last];
+    fleet->deadlines[instance] = fleet->deadlines[last];
+    if (context_size) {
+        memcpy(&fleet->contexts[instance * context_size], &fleet->contexts[last * context_size], context_size);
+    }
+}
+
+void* state_fleet_context(state_fleet_s* fleet, uint32_t instance) {
+    if (!fleet->machine->context_size || instance >= fleet->total) {
+        return NULL;
+    }
+    return &fleet->contexts[instance * fleet->machine->context_size];
+}
+
+// Applies event to every instance of the fleet, returns how many moved
+uint32_t state_fleet_apply(state_fleet_s* fleet, state_event_t event) {
+    uint32_t index = event - fleet->event_base;
+
+    // Not one of ours, or moves nobody
+    if (index >= fleet->total_events || !fleet->moves[index]) {
+        return 0;
+    }
+
+    const uint8_t* row    = fleet->transitions[index];
+    uint8_t*       states = fleet->states;
+    uint32_t       moved  = 0;
+    uint32_t       i      = 0;
+
+    if (fleet->on_transition) {
+        for (; i < fleet->total; i++) {
+            uint8_t from = states[i];
+            uint8_t to   = row[from];
+            if (to != from) {
+                states[i] = to;
+                moved++;
+                fleet->on_transition(fleet, i, from, to);
+            }
+        }
+        return moved;
+    }
+
+#ifdef FLEET_SHUFFLE
+    if (fleet->machine->total_states <= 16 && __builtin_cpu_supports("ssse3")) {
+        i = fleet_apply_shuffle(row, states, fleet->total, &moved);
+    }
+#endif
+
+    for (; i < fleet->total; i++) {
+        uint8_t from = states[i];
+        uint8_t to   = row[from];
+        moved += to != from;
+        states[i] = to;
+    }
+
+    return moved;
+}
+
+// Applies event to a single instance, returns 1 if it moved
+uint32_t state_fleet_apply_one(state_fleet_s* fleet, uint32_t instance, state_event_t event) {
+    uint32_t index = event - fleet->event_base;
+
+    if (instance >= fleet->total || index >= fleet->total_events) {
+        return 0;
+    }
+
+    uint8_t from = fleet->states[instance];
+    uint8_t to   = fleet->transitions[index][from];
+    if (to == from) {
+        return 0;
+    }
+
+    fleet->states[instance] = to;
+    if (fleet->on_transition) {
+        fleet->on_transition(fleet, instance, from, to);
+    }
+    return 1;
+}
+
+// Arms the timer of an instance, STATE_FLEET_NO_DEADLINE disarms it
+void state_fleet_arm(state_fleet_s* fleet, uint32_t instance, TickType_t deadline) {
+    if (instance < fleet->total) {
+        fleet->deadlines[instance] = deadline;
+    }
+}
+
+// Applies timeout_event to every instance whose deadline passed, and disarms
+// their timers. Returns the number of timers that fired.
+uint32_t state_fleet_expire(state_fleet_s* fleet, TickType_t now, state_event_t timeout_event) {
+    uint32_t fired = 0;
+
+    for (uint32_t i = 0; i < fleet->total; i++) {
+        TickType_t deadline = fleet->deadlines[i];
+        if (deadline != STATE_FLEET_NO_DEADLINE && !STATE_DEADLINE_BEFORE(now, deadline)) {
+            fleet->deadlines[i] = STATE_FLEET_NO_DEADLINE;
+            state_fleet_apply_one(fleet, i, timeout_event);
+            fired++;
+        }
+    }
+
+    return fired;
+}
+
+// Earliest armed deadline, STATE_FLEET_NO_DEADLINE if none is armed
+TickType_t state_fleet_next_deadline(state_fleet_s* fleet) {
+    TickType_t next = STATE_FLEET_NO_DEADLINE;
+
+    for (uint32_t i = 0; i < fleet->total; i++) {
+        TickType_t deadline = fleet->deadlines[i];
+        if (deadline != STATE_FLEET_NO_DEADLINE && (next == STATE_FLEET_NO_DEADLINE || STATE_DEADLINE_BEFORE(deadline, next))) {
+            next = deadline;
+        }
+    }
+
+    return next;
+}
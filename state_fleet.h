@@ -0,0 +1,88 @@
+#pragma once
+
+#include "state_core.h"
+
+/**********************************************************
+*                      DEFINES
+**********************************************************/
+#define STATE_FLEET_MAX_STATES  (64)  // States of a fleet machine, at most 256
+#define STATE_FLEET_MAX_EVENTS  (64)  // Consecutive events a fleet reacts to
+#define STATE_FLEET_NO_DEADLINE (portMAX_DELAY)
+
+/*********************************************************
+*                     TYPEDEFS
+**********************************************************/
+
+// Runs many instances of one state machine definition without a task, queue
+// or node per instance. Instances are kept as parallel arrays (state,
+// deadline, context), and next_state is replaced by a dense table holding the
+// next state of every state for every event, so an event is applied to the
+// whole fleet in one pass over the state array.
+//
+// The table is built by probing next_state once per state and event, so
+// next_state must be a pure function of the state and event (no
+// state_reply(), state_context() or other side effects). State functions are
+// not run, on_transition can be used for entry actions instead.
+//
+// A fleet is not thread safe, it is meant to be owned by a single task, for
+// example a state machine whose context points at the fleet:
+//
+// static void fleet_next_state(state_t* state, state_event_t event) {
+//     state_fleet_apply(state_context(), event);
+// }
+typedef struct state_fleet_s state_fleet_s;
+
+struct state_fleet_s {
+    // Definition of the instances
+    state_init_s* machine;
+
+    // The fleet reacts to events event_base .. event_base + total_events - 1
+    state_event_t event_base;
+    uint32_t      total_events;
+
+    // transitions[event - event_base][state] is the next state, or state
+    // itself when the event does not move it. moves[event - event_base] is
+    // false when the event moves no state at all.
+    uint8_t transitions[STATE_FLEET_MAX_EVENTS][STATE_FLEET_MAX_STATES];
+    bool    moves[STATE_FLEET_MAX_EVENTS];
+
+    // Instances, capacity entries each (contexts holds context_size bytes
+    // per instance). See STATE_FLEET_STORAGE
+    uint32_t    capacity;
+    uint32_t    total;
+    uint8_t*    states;
+    TickType_t* deadlines;
+    uint8_t*    contexts;
+
+    // If set, called for every instance an event moves, after the move
+    void (*on_transition)(state_fleet_s* fleet, uint32_t instance, state_t from, state_t to);
+};
+
+/**********************************************************
+*                        HELPERS
+**********************************************************/
+// Declares the instance arrays of a fleet, for example
+//
+// STATE_FLEET_STORAGE(conn, 4096, sizeof(conn_context_s));
+// state_fleet_init(&conn_fleet, &conn_definition, CONN_EVENT_START, 16, STATE_FLEET_STORAGE_ARGS(conn));
+#define STATE_FLEET_STORAGE(name, capacity, context_size)                  \
+    static uint8_t    name##_fleet_states[capacity];                     \
+    static TickType_t name##_fleet_deadlines[capacity];                  \
+    static uint8_t    name##_fleet_contexts[(capacity) * ((context_size) ? (context_size) : 1)]
+
+#define STATE_FLEET_STORAGE_ARGS(name)                                     \
+    sizeof(name##_fleet_states), name##_fleet_states, name##_fleet_deadlines, name##_fleet_contexts
+
+/**********************************************************
+*                   GLOBAL FUNCTIONS
+**********************************************************/
+void     state_fleet_init(state_fleet_s* fleet, state_init_s* machine, state_event_t event_base, uint32_t total_events,
+                          uint32_t capacity, uint8_t* states, TickType_t* deadlines, uint8_t* contexts);
+int32_t  state_fleet_add(state_fleet_s* fleet, const void* context);
+void     state_fleet_remove(state_fleet_s* fleet, uint32_t instance);
+void*    state_fleet_context(state_fleet_s* fleet, uint32_t instance);
+uint32_t state_fleet_apply(state_fleet_s* fleet, state_event_t event);
+uint32_t state_fleet_apply_one(state_fleet_s* fleet, uint32_t instance, state_event_t event);
+void     state_fleet_arm(state_fleet_s* fleet, uint32_t instance, TickType_t deadline);
+uint32_t state_fleet_expire(state_fleet_s* fleet, TickType_t now, state_event_t timeout_event);
+TickType_t state_fleet_next_deadline(state_fleet_s* fleet);
@@ -0,0 +1,233 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "FreeRTOS.h"
+
+#include "global_defines.h"
+#include "state_core.h"
+#include "state_harness.h"
+
+/**********************************************************
+*                                        STATIC VARIABLES *
+**********************************************************/
+static const char TAG[] = "STATE_HARNESS";
+
+/**********************************************************
+*                                               FUNCTIONS *
+**********************************************************/
+
+// Records that the machine entered state "to" from state "from"
+static void harness_enter(state_harness_s* harness, state_t from, state_t to) {
+    if (to >= harness->machine->total_states) {
+        ESP_LOGE(TAG, "%s moved to out of bounds state %u", harness->machine->state_name_string, to);
+        ASSERT(0);
+    }
+
+    if (harness->state_visits[to]++ == 0) {
+        harness->new_coverage++;
+    }
+
+    if (from != NULL_STATE) {
+        uint32_t* word = &harness->transitions[from][to / 32];
+        uint32_t  bit  = 1u << (to % 32);
+        if (!(*word & bit)) {
+            *word |= bit;
+            harness->new_coverage++;
+        } else {
+            mtCOVERAGE_TEST_MARKER();
+        }
+    }
+
+    harness->state  = to;
+    harness->replay = harness->total_deferred;
+}
+
+// True if the event falls in one of the ranges the machine subscribes to
+static bool harness_subscribed(state_init_s* machine, state_event_t event) {
+    if (!machine->total_subscriptions) {
+        return true;
+    }
+
+    for (int i = 0; i < machine->total_subscriptions; i++) {
+        if (event >= machine->subscriptions[i].first && event <= machine->subscriptions[i].last) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// True if the current state of the machine accepts the namespace of event
+static bool harness_accepts(state_harness_s* harness, state_event_t event) {
+    uint32_t namespaces = harness->machine->translation_table[harness->state].namespaces;
+    uint32_t ns         = event / STATE_NAMESPACE_SIZE;
+
+    return !namespaces || ns >= STATE_MAX_NAMESPACES || (namespaces & (1u << ns));
+}
+
+// Runs the state function of the current state, following forced
+// transitions until a state waits for an event (returns NULL_STATE)
+static void harness_run_state(state_harness_s* harness) {
+    if (!harness->run_state_functions) {
+        return;
+    }
+
+    for (int forced = 0; forced < STATE_HARNESS_MAX_FORCED; forced++) {
+        func_ptr state_func   = harness->machine->translation_table[harness->state].state_function_pointer;
+        state_t  forced_state = state_func();
+
+        if (forced_state == NULL_STATE) {
+            return;
+        }
+        harness_enter(harness, harness->state, forced_state);
+    }
+
+    harness->livelocks++;
+}
+
+void state_harness_init(state_harness_s* harness, state_init_s* machine, bool run_state_functions) {
+    if (!harness || !machine) {
+        ESP_LOGE(TAG, "ARG==NULL!");
+        ASSERT(0);
+    }
+
+    // Sanity check(s)
+    if (machine->next_state == NULL || machine->translation_table == NULL) {
+        ESP_LOGE(TAG, "ERROR! next_state / translation_table was NULL!");
+        ASSERT(0);
+    }
+
+    if (machine->total_states == 0 || machine->total_states > STATE_HARNESS_MAX_STATES) {
+        ESP_LOGE(TAG, "Total states of %s must be 1..%d", machine->state_name_string, STATE_HARNESS_MAX_STATES);
+        ASSERT(0);
+    }
+
+    memset(harness, 0, sizeof(state_harness_s));
+    harness->machine             = machine;
+    harness->run_state_functions = run_state_functions;
+
+    state_harness_reset(harness);
+}
+
+// Puts the machine back in its starting state, keeps the coverage
+void state_harness_reset(state_harness_s* harness) {
+    harness->total_deferred = 0;
+    harness_enter(harness, NULL_STATE, harness->machine->starting_state);
+    harness_run_state(harness);
+}
+
+// True if the current state defers event and there is room to hold it back
+static bool harness_defer(state_harness_s* harness, state_event_t event) {
+    state_init_s* machine   = harness->machine;
+    uint32_t      defer_bit = event - machine->defer_event_base;
+
+    if (defer_bit >= 32 || !(machine->translation_table[harness->state].defer & (1u << defer_bit)) ||
+        harness->total_deferred == STATE_DEFER_DEPTH) {
+        return false;
+    }
+
+    harness->deferred[harness->total_deferred++] = event;
+    return true;
+}
+
+// Delivers a single event as state_machine() does, without replaying
+static void harness_deliver(state_harness_s* harness, state_event_t event) {
+    state_init_s* machine = harness->machine;
+
+    if (event != INVALID_EVENT) {
+        // The event_multiplexer would never have delivered the event
+        bool wanted = STATE_IS_FLAG_EVENT(event) ? (machine->flag_mask & STATE_FLAG(event - STATE_FLAG_EVENT_START))
+                                                 : (harness_subscribed(machine, event) && harness_accepts(harness, event) &&
+                                                    (!machine->filter_event || machine->filter_event(event)));
+        if (!wanted) {
+            harness->filtered_events++;
+            return;
+        }
+
+        if (harness_defer(harness, event)) {
+            harness_run_state(harness);
+            return;
+        }
+
+        state_t state = harness->state;
+        machine->next_state(&state, event);
+        if (state != harness->state) {
+            harness_enter(harness, harness->state, state);
+        } else {
+            mtCOVERAGE_TEST_MARKER();
+        }
+    }
+
+    // state_machine() re-runs the current state after every event / timeout
+    harness_run_state(harness);
+}
+
+// Delivers a single event, INVALID_EVENT acts as a loop_timer timeout. Events
+// deferred earlier are delivered again after a state change.
+state_t state_harness_step(state_harness_s* harness, state_event_t event) {
+    harness_deliver(harness, event);
+
+    while (harness->replay) {
+        state_event_t deferred = harness->deferred[0];
+
+        harness->replay--;
+        harness->total_deferred--;
+        memmove(&harness->deferred[0], &harness->deferred[1], harness->total_deferred * sizeof(state_event_t));
+        harness_deliver(harness, deferred);
+    }
+
+    return harness->state;
+}
+
+// Runs one event sequence from the starting state, returns new coverage found
+uint32_t state_harness_run(state_harness_s* harness, const state_event_t* events, size_t len) {
+    uint32_t coverage_before = harness->new_coverage;
+
+    state_harness_reset(harness);
+    for (size_t i = 0; i < len; i++) {
+        state_harness_step(harness, events[i]);
+    }
+
+    return harness->new_coverage - coverage_before;
+}
+
+// Runs "sequences" random event sequences drawn from alphabet, returns new
+// coverage found. Add INVALID_EVENT to the alphabet to exercise loop timeouts.
+uint32_t state_harness_fuzz(state_harness_s* harness, const state_event_t* alphabet, size_t alphabet_len,
+                            uint32_t seed, uint32_t sequences, size_t sequence_len) {
+    if (!alphabet || alphabet_len == 0) {
+        ESP_LOGE(TAG, "Empty alphabet!");
+        ASSERT(0);
+    }
+
+    uint32_t coverage_before = harness->new_coverage;
+    uint32_t rng             = seed ? seed : 1; // xorshift32 gets stuck on 0
+
+    for (uint32_t sequence = 0; sequence < sequences; sequence++) {
+        state_harness_reset(harness);
+        for (size_t i = 0; i < sequence_len; i++) {
+            rng ^= rng << 13;
+            rng ^= rng >> 17;
+            rng ^= rng << 5;
+            state_harness_step(harness, alphabet[rng % alphabet_len]);
+        }
+    }
+
+    return harness->new_coverage - coverage_before;
+}
+
+void state_harness_report(state_harness_s* harness) {
+    state_init_s* machine = harness->machine;
+
+    ESP_LOGI(TAG, "Coverage of %s, filtered events = %u, livelocks = %u",
+             machine->state_name_string, harness->filtered_events, harness->livelocks);
+
+    for (state_t from = 0; from < machine->total_states; from++) {
+        ESP_LOGI(TAG, "  state %u entered %u times", from, harness->state_visits[from]);
+        for (state_t to = 0; to < machine->total_states; to++) {
+            if (harness->transitions[from][to / 32] & (1u << (to % 32))) {
+                ESP_LOGI(TAG, "    %u -> %u", from, to);
+            }
+        }
+    }
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include "state_core.h"
+
+/**********************************************************
+*                      DEFINES
+**********************************************************/
+#define STATE_HARNESS_MAX_STATES (64) // Must be a multiple of 32
+#define STATE_HARNESS_MAX_FORCED (64) // Forced transitions in a row before giving up
+
+/*********************************************************
+*                     TYPEDEFS
+**********************************************************/
+
+// Steps a state machine defined by a state_init_s synchronously, in-process,
+// with no scheduler, tasks or queues involved. Events are applied exactly as
+// state_machine() would apply them after the event_multiplexer delivered them,
+// so next_state, filter_event and the state functions can be driven with
+// generated or fuzzed event sequences at full CPU speed.
+//
+// While in the harness, state functions must not block (no vTaskDelay etc).
+// Machines whose state functions do block can still be tested by clearing
+// run_state_functions, in which case only filter_event / next_state are used.
+typedef struct {
+    // Machine under test
+    state_init_s* machine;
+
+    // Current state of the machine
+    state_t state;
+
+    // If set, the state function of every state entered is run, and forced
+    // transitions are followed, as state_machine() does
+    bool run_state_functions;
+
+    // Events rejected by filter_event (would not have been delivered)
+    uint32_t filtered_events;
+
+    // Number of times a chain of forced transitions did not settle after
+    // STATE_HARNESS_MAX_FORCED transitions
+    uint32_t livelocks;
+
+    // Events deferred by the states the machine went through, oldest first,
+    // replay of them are delivered again once the current event is done
+    state_event_t deferred[STATE_DEFER_DEPTH];
+    uint32_t      total_deferred;
+    uint32_t      replay;
+
+    // Number of never before seen states / transitions, reset by the caller
+    uint32_t new_coverage;
+
+    // Coverage, number of times each state was entered
+    uint32_t state_visits[STATE_HARNESS_MAX_STATES];
+
+    // Coverage, bit (to) of transitions[from] is set once from->to was taken
+    uint32_t transitions[STATE_HARNESS_MAX_STATES][STATE_HARNESS_MAX_STATES / 32];
+
+} state_harness_s;
+
+/**********************************************************
+*                   GLOBAL FUNCTIONS
+**********************************************************/
+void     state_harness_init(state_harness_s* harness, state_init_s* machine, bool run_state_functions);
+void     state_harness_reset(state_harness_s* harness);
+state_t  state_harness_step(state_harness_s* harness, state_event_t event);
+uint32_t state_harness_run(state_harness_s* harness, const state_event_t* events, size_t len);
+uint32_t state_harness_fuzz(state_harness_s* harness, const state_event_t* alphabet, size_t alphabet_len,
+                            uint32_t seed, uint32_t sequences, size_t sequence_len);
+void     state_harness_report(state_harness_s* harness);
@@ -0,0 +1,222 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "FreeRTOS.h"
+#include "task.h"
+
+#include "global_defines.h"
+#include "state_core.h"
+#include "state_ingress.h"
+
+#ifdef POSIX_FREERTOS_SIM
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+/**********************************************************
+*                                                TYPEDEFS *
+**********************************************************/
+typedef struct {
+    int      fd;   // -1 if the slot is free
+    uint32_t fill; // Bytes of a partial frame held in buffer
+    uint32_t buffer[STATE_INGRESS_BUFFER_SIZE / sizeof(uint32_t)];
+} ingress_client_t;
+
+/**********************************************************
+*                                        STATIC VARIABLES *
+**********************************************************/
+static const char TAG[] = "STATE_INGRESS";
+
+static int                   listen_fd = -1;
+static ingress_client_t      clients[STATE_INGRESS_MAX_CLIENTS];
+static state_ingress_stats_s ingress_stats;
+static TaskHandle_t          ingress_task;
+
+#if (STATE_CORE_STATIC_ALLOCATION == 1)
+static StaticTask_t ingress_task_buffer;
+static StackType_t  ingress_stack[STATE_INGRESS_STACK_DEPTH];
+#endif
+
+/**********************************************************
+*                                               FUNCTIONS *
+**********************************************************/
+
+static void ingress_close(ingress_client_t* client) {
+    close(client->fd);
+    client->fd   = -1;
+    client->fill = 0;
+}
+
+// Hands fd to a free client slot, returns false if there is none. Clients are
+// added by the ingress task and by state_ingress_add_client().
+static bool ingress_add(int fd) {
+    bool added = false;
+
+    taskENTER_CRITICAL();
+    for (int i = 0; i < STATE_INGRESS_MAX_CLIENTS && !added; i++) {
+        if (clients[i].fd < 0) {
+            clients[i].fill = 0;
+            clients[i].fd   = fd;
+            added           = true;
+        }
+    }
+    taskEXIT_CRITICAL();
+
+    if (!added) {
+        ESP_LOGW(TAG, "Too many ingress clients, raise STATE_INGRESS_MAX_CLIENTS");
+    }
+    return added;
+}
+
+static void ingress_accept() {
+    int fd = accept(listen_fd, NULL, NULL);
+    if (fd >= 0 && !ingress_add(fd)) {
+        close(fd);
+    }
+}
+
+// Reads what the client sent and posts every complete frame. A partial frame
+// is kept for the next read.
+static void ingress_read(ingress_client_t* client) {
+    uint8_t* bytes = (uint8_t*)client->buffer;
+    ssize_t  got   = recv(client->fd, bytes + client->fill, sizeof(client->buffer) - client->fill, 0);
+
+    if (got == 0 || (got < 0 && errno != EINTR && errno != EAGAIN)) {
+        ingress_stats.disconnects++;
+        ingress_close(client);
+        return;
+    }
+    if (got < 0) {
+        return;
+    }
+
+    // Frames are whole words, so every frame starts word aligned
+    uint32_t  fill  = client->fill + got;
+    uint32_t* frame = client->buffer;
+    uint32_t  left  = fill;
+
+    while (left >= sizeof(uint32_t)) {
+        uint32_t count = frame[0];
+        if (count > STATE_INGRESS_MAX_BATCH) {
+            ESP_LOGW(TAG, "Ingress frame of %u events, dropping client", count);
+            ingress_stats.rejected++;
+            ingress_close(client);
+            return;
+        }
+
+        uint32_t size = (count + 1) * sizeof(uint32_t);
+        if (left < size) {
+            break;
+        }
+
+        ingress_stats.events += state_post_events(&frame[1], count);
+        ingress_stats.batches++;
+        frame += count + 1;
+        left  -= size;
+    }
+
+    memmove(client->buffer, frame, left);
+    client->fill = left;
+}
+
+// Ingress task. poll() never blocks, a task blocked in a system call still
+// looks Running to FreeRTOS and would starve lower priority tasks. Once no
+// client has data the task sleeps with vTaskDelay() instead.
+static void ingress_loop(void* arg) {
+    struct pollfd fds[STATE_INGRESS_MAX_CLIENTS + 1];
+
+    for (;;) {
+        fds[0] = (struct pollfd){ .fd = listen_fd, .events = POLLIN };
+        for (int i = 0; i < STATE_INGRESS_MAX_CLIENTS; i++) {
+            fds[i + 1] = (struct pollfd){ .fd = clients[i].fd, .events = POLLIN };
+        }
+
+        if (poll(fds, STATE_INGRESS_MAX_CLIENTS + 1, 0) <= 0) {
+            vTaskDelay(STATE_INGRESS_POLL_TICKS);
+            continue;
+        }
+
+        for (int i = 0; i < STATE_INGRESS_MAX_CLIENTS; i++) {
+            if (clients[i].fd >= 0 && fds[i + 1].revents) {
+                ingress_read(&clients[i]);
+            }
+        }
+
+        if (fds[0].revents & POLLIN) {
+            ingress_accept();
+        }
+    }
+}
+
+// Listens on the Unix domain socket path (replacing a stale one) and starts
+// the ingress task
+bool state_ingress_start(const char* path) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+
+    if (!path || strlen(path) >= sizeof(addr.sun_path)) {
+        ESP_LOGE(TAG, "Bad ingress socket path!");
+        ASSERT(0);
+    }
+
+    if (ingress_task) {
+        ESP_LOGW(TAG, "Ingress already started");
+        return false;
+    }
+
+    strcpy(addr.sun_path, path);
+    unlink(path);
+
+    listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listen_fd < 0 || bind(listen_fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 ||
+        listen(listen_fd, STATE_INGRESS_MAX_CLIENTS) != 0) {
+        ESP_LOGE(TAG, "Failed to listen on %s", path);
+        if (listen_fd >= 0) {
+            close(listen_fd);
+        }
+        listen_fd = -1;
+        return false;
+    }
+
+    for (int i = 0; i < STATE_INGRESS_MAX_CLIENTS; i++) {
+        clients[i].fd = -1;
+    }
+
+#if (STATE_CORE_STATIC_ALLOCATION == 1)
+    ingress_task = xTaskCreateStatic(ingress_loop, "state_ingress", STATE_INGRESS_STACK_DEPTH, NULL,
+                                     STATE_INGRESS_PRIORITY, ingress_stack, &ingress_task_buffer);
+#else
+    if (pdPASS != xTaskCreate(ingress_loop, "state_ingress", STATE_INGRESS_STACK_DEPTH, NULL,
+                              STATE_INGRESS_PRIORITY, &ingress_task)) {
+        ingress_task = NULL;
+    }
+#endif
+    ASSERT(ingress_task);
+
+    ESP_LOGI(TAG, "Ingress listening on %s", path);
+    return true;
+}
+
+// Serves fd, a connected stream socket, as if it had connected to the ingress
+// socket (e.g one end of a socketpair()). Call after state_ingress_start(),
+// the ingress task owns fd from then on and closes it. Returns false, leaving
+// fd to the caller, if there is no free client slot.
+bool state_ingress_add_client(int fd) {
+    if (fd < 0 || !ingress_task) {
+        ESP_LOGE(TAG, "Bad ingress client, or ingress not started!");
+        ASSERT(0);
+    }
+    return ingress_add(fd);
+}
+
+void state_ingress_get_stats(state_ingress_stats_s* stats) {
+    if (!stats) {
+        ESP_LOGE(TAG, "ARG==NULL!");
+        ASSERT(0);
+    }
+    *stats = ingress_stats;
+}
+
+#endif
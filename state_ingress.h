@@ -0,0 +1,39 @@
+#pragma once
+
+#include "state_core.h"
+
+/**********************************************************
+*                      DEFINES
+**********************************************************/
+#define STATE_INGRESS_MAX_CLIENTS (4)
+#define STATE_INGRESS_MAX_BATCH   (256)  // Events per frame
+#define STATE_INGRESS_BUFFER_SIZE (8192) // Bytes read per client at once
+#define STATE_INGRESS_POLL_TICKS  (1)    // Sleep once no client has data
+#define STATE_INGRESS_STACK_DEPTH (4096) // In words
+#define STATE_INGRESS_PRIORITY    (STATE_MULTIPLEXER_PRIORITY)
+
+/*********************************************************
+*                     TYPEDEFS
+**********************************************************/
+
+// Injects events sent by other processes over a Unix domain stream socket,
+// so machines can be driven from test tools and sidecars.
+//
+// A client sends frames, each a uint32_t count followed by count events
+// (uint32_t, host byte order), at most STATE_INGRESS_MAX_BATCH per frame.
+// The ingress task reads whatever the socket holds with a single recv(), and
+// posts every complete frame with state_post_events(). A client sending a
+// bad frame is disconnected.
+typedef struct {
+    uint32_t batches;     // Frames posted
+    uint32_t events;      // Events posted
+    uint32_t rejected;    // Clients disconnected for a bad frame
+    uint32_t disconnects; // Clients that closed their end
+} state_ingress_stats_s;
+
+/**********************************************************
+*                   GLOBAL FUNCTIONS
+**********************************************************/
+bool state_ingress_start(const char* path);
+bool state_ingress_add_client(int fd);
+void state_ingress_get_stats(state_ingress_stats_s* stats);
@@ -0,0 +1,612 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "FreeRTOS.h"
+#include "semphr.h"
+#include "task.h"
+
+#include "global_defines.h"
+#include "state_core.h"
+#include "state_journal.h"
+
+#ifdef POSIX_FREERTOS_SIM
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/**********************************************************
+*                                                 DEFINES *
+**********************************************************/
+#define JOURNAL_RECORDS_AT (sizeof(state_journal_header_s))
+#define JOURNAL_CAPACITY   ((STATE_JOURNAL_SEGMENT_SIZE - JOURNAL_RECORDS_AT) / sizeof(state_journal_record_s))
+
+/**********************************************************
+*                                        STATIC VARIABLES *
+**********************************************************/
+static const char TAG[] = "STATE_JOURNAL";
+
+// The segment being appended to. Appends come from state_core holding
+// consumer_sem, the mappings are only swapped inside a critical section so
+// state_journal_sync() and the journal task can run from any task.
+static struct {
+    char                    dir[STATE_JOURNAL_MAX_PATH];
+    int                     fd;
+    uint8_t*                base;
+    state_journal_record_s* records;
+    uint32_t                segment;
+    uint32_t                next;     // Next record of the segment
+    uint32_t                seq;      // Sequence number of the next record
+    uint32_t                unsynced; // Records appended since the last msync()
+    uint32_t                synced;   // Records of the segment msync()ed
+    uint32_t                dropped;  // Records lost waiting for a spare segment
+
+    // Next segment, prepared by the journal task and swapped in once the
+    // current one is full
+    int      spare_fd;
+    uint8_t* spare_base;
+
+    // Full segment the journal task still has to write back and unmap
+    int      retired_fd;
+    uint8_t* retired_base;
+} journal = { .fd = -1, .spare_fd = -1, .retired_fd = -1 };
+
+// Held while unmapping a segment, so state_journal_sync() never syncs a
+// mapping that is going away. Appends never take it.
+static SemaphoreHandle_t journal_sem;
+static TaskHandle_t      journal_task;
+
+#if (STATE_CORE_STATIC_ALLOCATION == 1)
+static StaticSemaphore_t journal_sem_buffer;
+static StaticTask_t      journal_task_buffer;
+static StackType_t       journal_stack[STATE_JOURNAL_STACK_DEPTH];
+#endif
+
+/**********************************************************
+*                                               FUNCTIONS *
+**********************************************************/
+
+static uint32_t journal_check(const state_journal_record_s* record) {
+    uint32_t check = STATE_JOURNAL_MAGIC;
+
+    check = (check ^ record->seq) * 0x9E3779B1;
+    check = (check ^ record->tick) * 0x9E3779B1;
+    check = (check ^ record->event) * 0x9E3779B1;
+    check = (check ^ record->key) * 0x9E3779B1;
+    return check;
+}
+
+static void journal_path(char* path, const char* dir, uint32_t segment) {
+    snprintf(path, STATE_JOURNAL_MAX_PATH, "%s/journal.%08u", dir, segment);
+}
+
+// A segment cut short can't be mapped, touching past its end faults
+static bool journal_segment_complete(int fd) {
+    struct stat st;
+    return fstat(fd, &st) == 0 && st.st_size >= STATE_JOURNAL_SEGMENT_SIZE;
+}
+
+// Finds the lowest and highest segment in dir, returns false if there is none
+static bool journal_find_segments(const char* dir, uint32_t* lowest, uint32_t* highest) {
+    DIR* d = opendir(dir);
+    if (!d) {
+        return false;
+    }
+
+    bool           found = false;
+    struct dirent* entry;
+    while ((entry = readdir(d)) != NULL) {
+        uint32_t segment;
+        char     tail;
+        if (sscanf(entry->d_name, "journal.%8u%c", &segment, &tail) != 1) {
+            continue;
+        }
+
+        if (!found || segment < *lowest) {
+            *lowest = segment;
+        }
+        if (!found || segment > *highest) {
+            *highest = segment;
+        }
+        found = true;
+    }
+
+    closedir(d);
+    return found;
+}
+
+// Number of valid records in a mapped segment, starting with first_seq.
+// Calls replay on each of them if set.
+static uint32_t journal_scan(const uint8_t* base, uint32_t first_seq, state_journal_replay_f replay, void* arg) {
+    const state_journal_record_s* records = (const state_journal_record_s*)(base + JOURNAL_RECORDS_AT);
+    uint32_t                      valid   = 0;
+
+    while (valid < JOURNAL_CAPACITY) {
+        const state_journal_record_s* record = &records[valid];
+        if (record->seq != first_seq + valid || record->check != journal_check(record)) {
+            break;
+        }
+
+        if (replay) {
+            replay(record, arg);
+        }
+        valid++;
+    }
+
+    return valid;
+}
+
+// True if the header of a mapped segment is one of ours
+static bool journal_header_valid(const state_journal_header_s* header, uint32_t segment) {
+    return header->magic == STATE_JOURNAL_MAGIC && header->version == STATE_JOURNAL_VERSION &&
+           header->segment == segment && header->record_size == sizeof(state_journal_record_s);
+}
+
+static void journal_take() {
+    if (pdTRUE != xSemaphoreTake(journal_sem, SATE_MUTEX_WAIT)) {
+        ESP_LOGE(TAG, "FAILED TO TAKE journal_sem!");
+        ASSERT(0);
+    }
+}
+
+// Takes journal_sem for state_journal_close(), which also runs from exit() on
+// Ctrl+C with the scheduler suspended. Every other task is frozen then, and
+// waiting would trip configASSERT. Returns true if it has to be given back.
+static bool journal_take_for_close() {
+    if (xTaskGetSchedulerState() != taskSCHEDULER_RUNNING) {
+        return false;
+    }
+    journal_take();
+    return true;
+}
+
+// Opens and maps a segment file, creating and preallocating it if create is
+// set. A created segment has no magic yet, it only becomes part of the
+// journal once journal_publish() stamps it. Returns NULL on failure.
+static uint8_t* journal_map_file(uint32_t segment, bool create, int* fd_out) {
+    char path[STATE_JOURNAL_MAX_PATH];
+    journal_path(path, journal.dir, segment);
+
+    int fd = open(path, O_RDWR | (create ? O_CREAT | O_TRUNC : 0), 0644);
+    if (fd < 0) {
+        ESP_LOGE(TAG, "Failed to open %s", path);
+        return NULL;
+    }
+
+    // Reserve the blocks now, so appends never fault on a full disk
+    if (create && posix_fallocate(fd, 0, STATE_JOURNAL_SEGMENT_SIZE) != 0) {
+        ESP_LOGE(TAG, "Failed to preallocate %s", path);
+        close(fd);
+        return NULL;
+    }
+
+    if (!create && !journal_segment_complete(fd)) {
+        ESP_LOGE(TAG, "%s is truncated", path);
+        close(fd);
+        return NULL;
+    }
+
+    // Populated up front, appends then never take a page fault
+    uint8_t* base = mmap(NULL, STATE_JOURNAL_SEGMENT_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, 0);
+    if (base == MAP_FAILED) {
+        ESP_LOGE(TAG, "Failed to map %s", path);
+        close(fd);
+        return NULL;
+    }
+
+    state_journal_header_s* header = (state_journal_header_s*)base;
+    if (create) {
+        memset(header, 0, sizeof(state_journal_header_s));
+        header->version     = STATE_JOURNAL_VERSION;
+        header->segment     = segment;
+        header->record_size = sizeof(state_journal_record_s);
+    } else if (!journal_header_valid(header, segment)) {
+        ESP_LOGE(TAG, "%s is not a journal segment", path);
+        munmap(base, STATE_JOURNAL_SEGMENT_SIZE);
+        close(fd);
+        return NULL;
+    }
+
+    *fd_out = fd;
+    return base;
+}
+
+// Stamps a created segment as the one holding the records from first_seq on
+static void journal_publish(uint8_t* base, uint32_t first_seq) {
+    state_journal_header_s* header = (state_journal_header_s*)base;
+
+    header->first_seq = first_seq;
+    __atomic_store_n(&header->magic, STATE_JOURNAL_MAGIC, __ATOMIC_RELEASE);
+}
+
+// Makes a mapped segment the one appended to, its header must be valid
+static void journal_install(int fd, uint8_t* base) {
+    state_journal_header_s* header = (state_journal_header_s*)base;
+
+    taskENTER_CRITICAL();
+    journal.fd       = fd;
+    journal.base     = base;
+    journal.records  = (state_journal_record_s*)(base + JOURNAL_RECORDS_AT);
+    journal.segment  = header->segment;
+    journal.next     = 0;
+    journal.seq      = header->first_seq;
+    journal.unsynced = 0;
+    journal.synced   = 0;
+    taskEXIT_CRITICAL();
+}
+
+// Starts an empty journal at segment
+static bool journal_start(uint32_t segment) {
+    int      fd;
+    uint8_t* base = journal_map_file(segment, true, &fd);
+    if (!base) {
+        return false;
+    }
+
+    journal_publish(base, 0);
+    msync(base, sizeof(state_journal_header_s), MS_SYNC);
+    journal_install(fd, base);
+    return true;
+}
+
+// A spare segment that was never swapped in has no magic, deletes it.
+// Returns true if segment was one.
+static bool journal_drop_spare(const char* dir, uint32_t segment) {
+    char                   path[STATE_JOURNAL_MAX_PATH];
+    state_journal_header_s header;
+
+    journal_path(path, dir, segment);
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+
+    bool spare = pread(fd, &header, sizeof(header), 0) == sizeof(header) && header.magic == 0;
+    close(fd);
+
+    if (spare) {
+        unlink(path);
+    }
+    return spare;
+}
+
+// Syncs and unmaps every segment, an unused spare is deleted
+static void journal_unmap_segments() {
+    bool locked = journal_take_for_close();
+    taskENTER_CRITICAL();
+    uint8_t* base         = journal.base;
+    int      fd           = journal.fd;
+    uint8_t* spare_base   = journal.spare_base;
+    int      spare_fd     = journal.spare_fd;
+    uint8_t* retired_base = journal.retired_base;
+    int      retired_fd   = journal.retired_fd;
+    uint32_t segment      = journal.segment;
+    journal.base          = NULL;
+    journal.records       = NULL;
+    journal.fd            = -1;
+    journal.spare_base    = NULL;
+    journal.spare_fd      = -1;
+    journal.retired_base  = NULL;
+    journal.retired_fd    = -1;
+    taskEXIT_CRITICAL();
+
+    if (retired_base) {
+        msync(retired_base, STATE_JOURNAL_SEGMENT_SIZE, MS_SYNC);
+        munmap(retired_base, STATE_JOURNAL_SEGMENT_SIZE);
+        close(retired_fd);
+    }
+
+    if (base) {
+        msync(base, STATE_JOURNAL_SEGMENT_SIZE, MS_SYNC);
+        munmap(base, STATE_JOURNAL_SEGMENT_SIZE);
+        close(fd);
+    }
+
+    if (spare_base) {
+        char path[STATE_JOURNAL_MAX_PATH];
+        munmap(spare_base, STATE_JOURNAL_SEGMENT_SIZE);
+        close(spare_fd);
+        journal_path(path, journal.dir, segment + 1);
+        unlink(path);
+    }
+
+    if (locked) {
+        xSemaphoreGive(journal_sem);
+    }
+}
+
+// Swaps in the spare segment once the current one is full, must be called
+// inside the critical section. Only pointers move here, the journal task
+// writes back and unmaps the full segment and prepares the next spare.
+// Returns false if the journal task has not caught up yet.
+static bool journal_rotate() {
+    if (!journal.spare_base || journal.retired_base) {
+        return false;
+    }
+
+    journal_publish(journal.spare_base, journal.seq);
+
+    journal.retired_base = journal.base;
+    journal.retired_fd   = journal.fd;
+    journal.base         = journal.spare_base;
+    journal.fd           = journal.spare_fd;
+    journal.records      = (state_journal_record_s*)(journal.base + JOURNAL_RECORDS_AT);
+    journal.segment++;
+    journal.next         = 0;
+    journal.unsynced     = 0;
+    journal.synced       = 0;
+    journal.spare_base   = NULL;
+    journal.spare_fd     = -1;
+    return true;
+}
+
+// Writes back and unmaps the segment journal_rotate() swapped out, without
+// waiting for the disk, and deletes the segment falling out of the
+// STATE_JOURNAL_MAX_SEGMENTS window
+static void journal_retire() {
+    journal_take();
+    taskENTER_CRITICAL();
+    uint8_t* base        = journal.retired_base;
+    int      fd          = journal.retired_fd;
+    uint32_t segment     = journal.segment;
+    journal.retired_base = NULL;
+    journal.retired_fd   = -1;
+    taskEXIT_CRITICAL();
+
+    if (base) {
+        msync(base, STATE_JOURNAL_SEGMENT_SIZE, MS_ASYNC);
+        munmap(base, STATE_JOURNAL_SEGMENT_SIZE);
+        close(fd);
+    }
+    xSemaphoreGive(journal_sem);
+
+    if (base && segment >= STATE_JOURNAL_MAX_SEGMENTS) {
+        char path[STATE_JOURNAL_MAX_PATH];
+        journal_path(path, journal.dir, segment - STATE_JOURNAL_MAX_SEGMENTS);
+        unlink(path);
+    }
+}
+
+// Creates, preallocates and maps the segment after the current one, so
+// journal_rotate() finds it ready
+static void journal_prepare_spare() {
+    taskENTER_CRITICAL();
+    bool     needed  = journal.records && !journal.spare_base;
+    uint32_t segment = journal.segment + 1;
+    taskEXIT_CRITICAL();
+
+    if (!needed) {
+        return;
+    }
+
+    int      fd;
+    uint8_t* base = journal_map_file(segment, true, &fd);
+    if (!base) {
+        return;
+    }
+
+    taskENTER_CRITICAL();
+    journal.spare_base = base;
+    journal.spare_fd   = fd;
+    taskEXIT_CRITICAL();
+}
+
+// Journal task, does the slow file work of rotating off the routing path
+static void journal_loop(void* arg) {
+    for (;;) {
+        journal_retire();
+        journal_prepare_spare();
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    }
+}
+
+// Page aligned range of the records appended since the last sync, which is
+// then considered done. Must be called inside the critical section.
+static size_t journal_unsynced_range(long page, uint8_t** start) {
+    uint8_t* from = (uint8_t*)&journal.records[journal.synced];
+    uint8_t* to   = (uint8_t*)&journal.records[journal.next];
+
+    *start           = journal.base + ((from - journal.base) / page) * page;
+    journal.synced   = journal.next;
+    journal.unsynced = 0;
+    return to - *start;
+}
+
+// Opens the journal in dir, which must exist. Appending resumes after the
+// last valid record of the newest segment, anything past it is zeroed.
+bool state_journal_open(const char* dir) {
+    if (!dir || strlen(dir) >= STATE_JOURNAL_MAX_PATH - sizeof("/journal.00000000")) {
+        ESP_LOGE(TAG, "Bad journal directory!");
+        ASSERT(0);
+    }
+
+    if (journal.base) {
+        ESP_LOGW(TAG, "Journal already open");
+        return false;
+    }
+
+    strcpy(journal.dir, dir);
+
+    if (!journal_task) {
+#if (STATE_CORE_STATIC_ALLOCATION == 1)
+        journal_sem  = xSemaphoreCreateMutexStatic(&journal_sem_buffer);
+        journal_task = xTaskCreateStatic(journal_loop, "state_journal", STATE_JOURNAL_STACK_DEPTH, NULL,
+                                         STATE_JOURNAL_PRIORITY, journal_stack, &journal_task_buffer);
+#else
+        journal_sem = xSemaphoreCreateMutex();
+        if (pdPASS != xTaskCreate(journal_loop, "state_journal", STATE_JOURNAL_STACK_DEPTH, NULL,
+                                  STATE_JOURNAL_PRIORITY, &journal_task)) {
+            journal_task = NULL;
+        }
+#endif
+        ASSERT(journal_sem);
+        ASSERT(journal_task);
+
+        // Records still only in the page cache make it to disk on a clean exit
+        atexit(state_journal_close);
+    }
+
+    // A spare left behind is not part of the journal
+    uint32_t lowest, highest;
+    bool     found = journal_find_segments(dir, &lowest, &highest);
+    if (found && journal_drop_spare(dir, highest)) {
+        found = highest-- != lowest;
+    }
+
+    bool opened;
+    if (!found) {
+        opened = journal_start(0);
+    } else {
+        int      fd;
+        uint8_t* base = journal_map_file(highest, false, &fd);
+        if (!base) {
+            return false;
+        }
+        journal_install(fd, base);
+
+        // Resume after the last record that made it, and clear any torn or
+        // stale records past it so a later scan can't pick them up
+        uint32_t valid = journal_scan(journal.base, journal.seq, NULL, NULL);
+        journal.next   = valid;
+        journal.synced = valid;
+        journal.seq   += valid;
+        memset(&journal.records[valid], 0, (JOURNAL_CAPACITY - valid) * sizeof(state_journal_record_s));
+        msync(journal.base, STATE_JOURNAL_SEGMENT_SIZE, MS_SYNC);
+
+        ESP_LOGI(TAG, "Journal resumed at segment %u, sequence %u", highest, journal.seq);
+        opened = true;
+    }
+
+    if (opened) {
+        xTaskNotifyGive(journal_task);
+    }
+    return opened;
+}
+
+// Records an event, called by state_core holding consumer_sem. The segment
+// is looked up and the record written inside the critical section, so
+// state_journal_close() can't unmap it halfway. The system calls are made
+// after leaving it, msync() of a range unmapped meanwhile just fails.
+void state_journal_append(state_event_t event, uint32_t key) {
+    long     page      = sysconf(_SC_PAGESIZE);
+    uint8_t* sync_from = NULL;
+    size_t   sync_len  = 0;
+    bool     rotated   = false;
+    uint32_t dropped   = 0;
+
+    taskENTER_CRITICAL();
+    if (journal.records && journal.next == JOURNAL_CAPACITY) {
+        rotated = journal_rotate();
+        if (!rotated) {
+            dropped = ++journal.dropped;
+        }
+    }
+
+    if (journal.records && !dropped) {
+        state_journal_record_s* record = &journal.records[journal.next];
+        record->seq   = journal.seq;
+        record->tick  = xTaskGetTickCount();
+        record->event = event;
+        record->key   = key;
+        __atomic_store_n(&record->check, journal_check(record), __ATOMIC_RELEASE);
+
+        journal.next++;
+        journal.seq++;
+        if (++journal.unsynced == STATE_JOURNAL_SYNC_RECORDS) {
+            sync_len = journal_unsynced_range(page, &sync_from);
+        }
+    }
+    taskEXIT_CRITICAL();
+
+    // The journal task retires the full segment and prepares the next spare,
+    // and keeps trying while records are dropped
+    if (rotated || dropped) {
+        xTaskNotifyGive(journal_task);
+    }
+    if (dropped && ((dropped - 1) & 0xFF) == 0) {
+        ESP_LOGW(TAG, "No spare journal segment yet, %u records dropped", dropped);
+    }
+    if (sync_len) {
+        msync(sync_from, sync_len, MS_ASYNC);
+    }
+}
+
+// Waits until every record appended so far is on disk, including those of a
+// full segment the journal task did not write back yet. The mappings are only
+// looked up under the critical section, msync() may take a while.
+void state_journal_sync(void) {
+    if (!journal_sem) {
+        return;
+    }
+
+    journal_take();
+    taskENTER_CRITICAL();
+    uint8_t* base    = journal.base;
+    uint8_t* retired = journal.retired_base;
+    taskEXIT_CRITICAL();
+
+    if (retired) {
+        msync(retired, STATE_JOURNAL_SEGMENT_SIZE, MS_SYNC);
+    }
+    if (base) {
+        msync(base, STATE_JOURNAL_SEGMENT_SIZE, MS_SYNC);
+    }
+    xSemaphoreGive(journal_sem);
+}
+
+void state_journal_close(void) {
+    if (journal_sem) {
+        journal_unmap_segments();
+    }
+}
+
+// Replays every valid record in dir, oldest first, returns how many. Meant to
+// run before state_journal_open() on the same directory.
+uint32_t state_journal_recover(const char* dir, state_journal_replay_f replay, void* arg) {
+    uint32_t lowest, highest;
+    uint32_t total = 0;
+
+    if (!dir || !journal_find_segments(dir, &lowest, &highest)) {
+        return 0;
+    }
+
+    for (uint32_t segment = lowest; segment <= highest; segment++) {
+        char path[STATE_JOURNAL_MAX_PATH];
+        journal_path(path, dir, segment);
+
+        int fd = open(path, O_RDONLY);
+        if (fd < 0) {
+            ESP_LOGW(TAG, "Journal segment %u is missing", segment);
+            continue;
+        }
+
+        if (!journal_segment_complete(fd)) {
+            ESP_LOGW(TAG, "Journal segment %u is truncated", segment);
+            close(fd);
+            continue;
+        }
+
+        uint8_t* base = mmap(NULL, STATE_JOURNAL_SEGMENT_SIZE, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (base == MAP_FAILED) {
+            ESP_LOGW(TAG, "Failed to map journal segment %u", segment);
+            continue;
+        }
+
+        state_journal_header_s* header = (state_journal_header_s*)base;
+        if (journal_header_valid(header, segment)) {
+            total += journal_scan(base, header->first_seq, replay, arg);
+        } else if (header->magic != 0) {
+            // No magic is a spare that was never swapped in, not an error
+            ESP_LOGW(TAG, "Journal segment %u has a bad header", segment);
+        }
+
+        munmap(base, STATE_JOURNAL_SEGMENT_SIZE);
+    }
+
+    return total;
+}
+
+#endif
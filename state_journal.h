@@ -0,0 +1,70 @@
+#pragma once
+
+#include "state_core.h"
+
+/**********************************************************
+*                      DEFINES
+**********************************************************/
+#define STATE_JOURNAL_MAGIC         (0x534A524E) // "SJRN"
+#define STATE_JOURNAL_VERSION       (1)
+#define STATE_JOURNAL_SEGMENT_SIZE  (1024 * 1024) // Bytes per segment file
+#define STATE_JOURNAL_MAX_SEGMENTS  (8)           // Older segments are deleted
+#define STATE_JOURNAL_SYNC_RECORDS  (256)         // Records between msync()s
+#define STATE_JOURNAL_MAX_PATH      (256)
+#define STATE_JOURNAL_NO_KEY        (0xFFFFFFFF)  // Key of a non keyed event
+#define STATE_JOURNAL_STACK_DEPTH   (2048)        // Journal task, in words
+#define STATE_JOURNAL_PRIORITY      (tskIDLE_PRIORITY + 1)
+
+/*********************************************************
+*                     TYPEDEFS
+**********************************************************/
+
+// Write-ahead journal of the events accepted by state_core, for audit and
+// crash recovery. Only built for the POSIX simulator.
+//
+// The journal is a directory of preallocated, memory-mapped segment files
+// (journal.00000000, journal.00000001, ...). Each segment starts with a
+// state_journal_header_s followed by fixed size records. Appending a record
+// is a few stores into the mapping, the kernel writes the pages back and
+// msync() is only asked for every STATE_JOURNAL_SYNC_RECORDS records, when a
+// segment fills up, and in state_journal_sync(). A process crash loses
+// nothing, a power loss loses at most the records since the last sync.
+//
+// A low priority journal task keeps the next segment preallocated and mapped
+// as a spare, its header has no magic until it is swapped in. Rotating is
+// then only a pointer swap, the task writes back (MS_ASYNC) and unmaps the
+// full segment, deletes the one falling out of the window and prepares the
+// next spare. Records arriving while no spare is ready are dropped.
+//
+// Events posted through the event_multiplexer (including delayed events) and
+// keyed events are journaled as they are routed. Flags, calls, messages and
+// bus events are not.
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t segment;     // Index of the segment, in its file name too
+    uint32_t first_seq;   // Sequence number of the first record
+    uint32_t record_size;
+    uint32_t reserved[3];
+} state_journal_header_s;
+
+// check is written last, a record whose check does not match its fields is
+// where the journal ends (the rest of a segment is zeroed)
+typedef struct {
+    uint32_t      seq;
+    TickType_t    tick;
+    state_event_t event;
+    uint32_t      key; // STATE_JOURNAL_NO_KEY unless posted as a keyed event
+    uint32_t      check;
+} state_journal_record_s;
+
+typedef void (*state_journal_replay_f)(const state_journal_record_s* record, void* arg);
+
+/**********************************************************
+*                   GLOBAL FUNCTIONS
+**********************************************************/
+bool     state_journal_open(const char* dir);
+void     state_journal_append(state_event_t event, uint32_t key);
+void     state_journal_sync(void);
+void     state_journal_close(void);
+uint32_t state_journal_recover(const char* dir, state_journal_replay_f replay, void* arg);
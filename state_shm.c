@@ -0,0 +1,173 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "FreeRTOS.h"
+#include "task.h"
+
+#include "global_defines.h"
+#include "state_core.h"
+#include "state_shm.h"
+
+#ifdef POSIX_FREERTOS_SIM
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+/**********************************************************
+*                                                 DEFINES *
+**********************************************************/
+#define SHM_CLAIMED          (1)  // Magic while the creator stamps the header
+#define SHM_CLAIM_WAIT_TICKS (10) // How long to wait for it
+
+/**********************************************************
+*                                        STATIC VARIABLES *
+**********************************************************/
+static const char TAG[] = "STATE_SHM";
+
+/**********************************************************
+*                                               FUNCTIONS *
+**********************************************************/
+
+// Event tap, the registry lock makes it the only writer of tx
+static void shm_forward(state_event_t event, void* arg) {
+    state_shm_bridge_s* bridge = arg;
+    state_shm_ring_s*   tx     = bridge->tx;
+    uint32_t            head   = tx->head;
+
+    if (head - __atomic_load_n(&tx->tail, __ATOMIC_ACQUIRE) >= STATE_SHM_RING_DEPTH) {
+        if ((bridge->dropped++ & 0xFF) == 0) {
+            ESP_LOGW(TAG, "Peer of %s is not keeping up, %u events dropped", bridge->name, bridge->dropped);
+        }
+        return;
+    }
+
+    tx->events[head % STATE_SHM_RING_DEPTH] = event;
+    __atomic_store_n(&tx->head, head + 1, __ATOMIC_RELEASE);
+    bridge->forwarded++;
+}
+
+// Receiver task, the only reader of rx. Posts what the other process wrote,
+// and sleeps a tick once the ring is empty.
+static void shm_receiver(void* arg) {
+    state_shm_bridge_s* bridge = arg;
+    state_shm_ring_s*   rx     = bridge->rx;
+
+    for (;;) {
+        uint32_t tail = rx->tail;
+
+        while (tail != __atomic_load_n(&rx->head, __ATOMIC_ACQUIRE)) {
+            // The event_multiplexer queue is full, give it a tick to drain
+            if (!state_post_remote_event(rx->events[tail % STATE_SHM_RING_DEPTH])) {
+                vTaskDelay(1);
+                continue;
+            }
+
+            tail++;
+            __atomic_store_n(&rx->tail, tail, __ATOMIC_RELEASE);
+            bridge->received++;
+        }
+
+        vTaskDelay(STATE_SHM_POLL_TICKS);
+    }
+}
+
+// Maps the shared memory object name (e.g "/state_bus"), creating it if the
+// other process did not yet. Returns NULL on failure.
+static state_shm_layout_s* shm_map(const char* name) {
+    int fd = shm_open(name, O_RDWR | O_CREAT, 0600);
+    if (fd < 0) {
+        ESP_LOGE(TAG, "Failed to open shared memory %s", name);
+        return NULL;
+    }
+
+    // A new object reads as zeroes, which is an empty bridge
+    if (ftruncate(fd, sizeof(state_shm_layout_s)) != 0) {
+        ESP_LOGE(TAG, "Failed to size shared memory %s", name);
+        close(fd);
+        return NULL;
+    }
+
+    state_shm_layout_s* shm = mmap(NULL, sizeof(state_shm_layout_s), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (shm == MAP_FAILED) {
+        ESP_LOGE(TAG, "Failed to map shared memory %s", name);
+        return NULL;
+    }
+
+    // Whoever claims the object first stamps the version, then publishes the
+    // magic. The other side waits for the magic and only compares.
+    uint32_t magic = 0;
+    if (__atomic_compare_exchange_n(&shm->magic, &magic, SHM_CLAIMED, false, __ATOMIC_SEQ_CST, __ATOMIC_ACQUIRE)) {
+        shm->version = STATE_SHM_VERSION;
+        __atomic_store_n(&shm->magic, STATE_SHM_MAGIC, __ATOMIC_RELEASE);
+        magic = STATE_SHM_MAGIC;
+    }
+
+    for (int i = 0; magic == SHM_CLAIMED && i < SHM_CLAIM_WAIT_TICKS; i++) {
+        vTaskDelay(1);
+        magic = __atomic_load_n(&shm->magic, __ATOMIC_ACQUIRE);
+    }
+
+    if (magic != STATE_SHM_MAGIC || shm->version != STATE_SHM_VERSION) {
+        ESP_LOGE(TAG, "%s is not a state_core bridge", name);
+        munmap(shm, sizeof(state_shm_layout_s));
+        return NULL;
+    }
+
+    return shm;
+}
+
+// Opens side (0 or 1) of the bridge name and starts forwarding. exports may
+// be NULL for a bridge that only receives, and must stay valid otherwise.
+// The bridge stays open until the process exits.
+bool state_shm_bridge_open(state_shm_bridge_s* bridge, const char* name, int side,
+                           const state_range_s* exports, int total_exports) {
+    if (!bridge || !name || (total_exports && !exports)) {
+        ESP_LOGE(TAG, "ARG==NULL!");
+        ASSERT(0);
+    }
+
+    // Sanity check(s)
+    if ((side != 0 && side != 1) || strlen(name) >= STATE_SHM_MAX_NAME) {
+        ESP_LOGE(TAG, "Bad side / name of bridge %s", name);
+        ASSERT(0);
+    }
+
+    memset(bridge, 0, sizeof(state_shm_bridge_s));
+    strcpy(bridge->name, name);
+    bridge->side          = side;
+    bridge->exports       = exports;
+    bridge->total_exports = total_exports;
+
+    bridge->shm = shm_map(name);
+    if (!bridge->shm) {
+        return false;
+    }
+    bridge->tx = &bridge->shm->rings[side];
+    bridge->rx = &bridge->shm->rings[!side];
+
+    // The tap goes first, nothing is left running or mapped if there is no
+    // room for it
+    if (total_exports && !state_add_event_tap(exports, total_exports, shm_forward, bridge)) {
+        munmap(bridge->shm, sizeof(state_shm_layout_s));
+        bridge->shm = NULL;
+        return false;
+    }
+
+#if (STATE_CORE_STATIC_ALLOCATION == 1)
+    bridge->task = xTaskCreateStatic(shm_receiver, "shm_receiver", STATE_SHM_STACK_DEPTH, bridge,
+                                     STATE_SHM_PRIORITY, bridge->stack, &bridge->task_buffer);
+#else
+    if (pdPASS != xTaskCreate(shm_receiver, "shm_receiver", STATE_SHM_STACK_DEPTH, bridge,
+                              STATE_SHM_PRIORITY, &bridge->task)) {
+        bridge->task = NULL;
+    }
+#endif
+    ASSERT(bridge->task);
+
+    ESP_LOGI(TAG, "Bridge %s open on side %d", name, side);
+    return true;
+}
+
+#endif
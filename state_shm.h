@@ -0,0 +1,84 @@
+#pragma once
+
+#include "state_core.h"
+#include "task.h"
+
+/**********************************************************
+*                      DEFINES
+**********************************************************/
+#define STATE_SHM_MAGIC        (0x5353484D) // "SSHM"
+#define STATE_SHM_VERSION      (2)
+#define STATE_SHM_RING_DEPTH   (1024)      // Events per direction, power of two
+#define STATE_SHM_MAX_NAME     (64)
+#define STATE_SHM_POLL_TICKS   (1)         // Receiver sleep once its ring is empty
+#define STATE_SHM_STACK_DEPTH  (2048)      // Receiver task, in words
+#define STATE_SHM_PRIORITY     (STATE_MULTIPLEXER_PRIORITY)
+
+/*********************************************************
+*                     TYPEDEFS
+**********************************************************/
+
+// One direction of a bridge, written by one process and read by the other.
+// head and tail sit on cache lines of their own.
+typedef struct {
+    volatile uint32_t head; // Next event the writer fills
+    uint8_t           head_line[60];
+    volatile uint32_t tail;          // Next event the reader takes
+    uint8_t           tail_line[60];
+    state_event_t     events[STATE_SHM_RING_DEPTH];
+} state_shm_ring_s;
+
+// Shared memory object of a bridge, side 0 writes rings[0] and reads
+// rings[1], side 1 the other way around
+typedef struct {
+    uint32_t         magic;
+    uint32_t         version;
+    uint8_t          header_line[56];
+    state_shm_ring_s rings[2];
+} state_shm_layout_s;
+
+// Forwards state_core events between two processes on one host through a
+// POSIX shared memory object. Events posted locally in the export ranges are
+// written to the ring of this side by an event tap, the receiver task of the
+// other process posts them with state_post_remote_event(). Each ring has a
+// single writer (the tap, serialized by the registry lock) and a single
+// reader (the receiver task), so neither takes a lock of its own. Once its
+// ring is empty the receiver sleeps for STATE_SHM_POLL_TICKS with
+// vTaskDelay(), a blocking wait outside of FreeRTOS would keep the scheduler
+// from running lower priority tasks.
+//
+// The two processes open the same name, one with side 0 and the other with
+// side 1. Events are dropped, and counted, if the other process does not
+// keep up.
+//
+// There is no close, event taps can not be removed. An open bridge lives as
+// long as the process, its state_shm_bridge_s and exports must stay valid
+// until then. The shared memory object outlives both processes until it is
+// removed with shm_unlink().
+typedef struct {
+    char                name[STATE_SHM_MAX_NAME];
+    int                 side;
+    state_shm_layout_s* shm;
+    state_shm_ring_s*   tx;
+    state_shm_ring_s*   rx;
+
+    // Events of these ranges are forwarded to the other process
+    const state_range_s* exports;
+    int                  total_exports;
+
+    TaskHandle_t task;
+#if (STATE_CORE_STATIC_ALLOCATION == 1)
+    StaticTask_t task_buffer;
+    StackType_t  stack[STATE_SHM_STACK_DEPTH];
+#endif
+
+    uint32_t forwarded;
+    uint32_t received;
+    uint32_t dropped;
+} state_shm_bridge_s;
+
+/**********************************************************
+*                   GLOBAL FUNCTIONS
+**********************************************************/
+bool state_shm_bridge_open(state_shm_bridge_s* bridge, const char* name, int side,
+                           const state_range_s* exports, int total_exports);
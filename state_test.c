@@ -34,7 +34,7 @@ static const char        TAG[] = "NET_STATE";
 // Translation Table
 static state_array_s test_translation_table[test_state_len] = {
   { state_a_func ,  portMAX_DELAY },
-  { state_b_func ,  5000          }, 
+  { state_b_func ,  portMAX_DELAY }, 
 };
 
 /**********************************************************
@@ -47,10 +47,7 @@ static state_t state_a_func() {
 
 static state_t state_b_func() {
   ESP_LOGI(TAG, "Entering state B");
-
-  vTaskDelay( 5000 / portTICK_PERIOD_MS );
-  ESP_LOGI(TAG, "forcing B->A transition!");
-  return test_state_a;
+  return NULL_STATE;
 }
 
 // Returns the next state
@@ -60,6 +57,17 @@ static void next_state_func(state_t* curr_state, state_event_t event) {
         case (STATE_A2B_TRANSITION ):
             ESP_LOGI(TAG, "A->B transition!");
             *curr_state = test_state_b;
+
+            // Don't sleep in state B, have the core post the B->A event later.
+            // Armed on the transition, state B runs again on every event.
+            state_post_event_after(STATE_B2A_TRANSITION, 5000 / portTICK_PERIOD_MS);
+            break;
+      }
+  } else if (*curr_state == test_state_b) {
+      switch(event){
+        case (STATE_B2A_TRANSITION ):
+            ESP_LOGI(TAG, "B->A transition!");
+            *curr_state = test_state_a;
             break;
       }
   }
@@ -73,9 +81,15 @@ static char* event_print_func(state_event_t event) {
 static bool event_filter_func(state_event_t event) {
   switch(event){
     case(STATE_A2B_TRANSITION)   : return true; 
+    case(STATE_B2A_TRANSITION)   : return true; 
   }
+  return false;
 }
 
+#if (STATE_CORE_STATIC_ALLOCATION == 1)
+STATE_MACHINE_STATIC_STORAGE(test_state, 4096);
+#endif
+
 static state_init_s* get_test_handle() {
     static state_init_s parser_state = {
         .next_state        = next_state_func,
@@ -85,6 +99,9 @@ static state_init_s* get_test_handle() {
         .state_name_string = "test_state",
         .filter_event      = event_filter_func,
         .total_states      = test_state_len,  
+#if (STATE_CORE_STATIC_ALLOCATION == 1)
+        STATE_MACHINE_STATIC_INIT(test_state),
+#endif
     };
     return &(parser_state);
 }
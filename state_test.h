@@ -23,6 +23,7 @@ typedef enum {
 
 typedef enum {
     STATE_A2B_TRANSITION = 0,
+    STATE_B2A_TRANSITION,
 } test_event_e;
 
 